@@ -4,27 +4,194 @@
  */
 
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <xcb/xcbext.h>
 #include "ghost.h"
 #include "ghost_data.h"
 #include "ghost_parser.h"
+#include "ghost_rules.h"
 
 #define OPAQUE 0xffffffff
+
+/* Converts a float opacity into the value of the opacity property */
+#define OPACITY_VALUE( X ) ((uint32_t) ((X) * OPAQUE))
 #define OPACITY "_NET_WM_WINDOW_OPACITY"
+#define CLIENT_LIST "_NET_CLIENT_LIST"
+#define CLIENT_LIST_STACKING "_NET_CLIENT_LIST_STACKING"
+#define ACTIVE_WINDOW "_NET_ACTIVE_WINDOW"
+
+/*
+ * Events selected on windows that may need to be matched again: property
+ * changes and the window's own destruction. The structure events of root
+ * children are already reported through the root window, so they only
+ * get ROOT_CHILD_WATCH_EVENTS.
+ */
+#define WATCH_EVENTS ( XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY )
+#define ROOT_CHILD_WATCH_EVENTS XCB_EVENT_MASK_PROPERTY_CHANGE
+
+/*
+ * The time, in milliseconds, after which a new window that has not been
+ * mapped and has not changed a rule property is matched anyway. It is
+ * matched once; later property changes are reported by PropertyNotify.
+ */
+#define MATCH_DELAY 100
+
+/*
+ * The smallest parent map size at which stale entries are pruned while
+ * monitoring. The map is pruned again once it doubles in size.
+ */
+#define PARENT_PRUNE_MIN 1024
+
+/*
+ * The shortest time, in milliseconds, between two reports of the opacity
+ * writes skipped while monitoring.
+ */
+#define SAVED_WRITES_REPORT_INTERVAL 60000
+
+/*
+ * Convenience object for initializing empty window arrays.
+ */
+static const win_array_t EMPTY_WIN_ARRAY = { NULL, 0, 0 };
+
+/*
+ * A cached match property of a window. The value points into the
+ * reply, which is NULL if the window does not have the property.
+ */
+typedef struct cached_prop_t {
+    xcb_atom_t atom;
+    xcb_get_property_reply_t *reply;
+    ght_value_t value;
+} cached_prop_t;
+
+/*
+ * The cached match properties of a single tracked window. Entries are
+ * added by the match fetches and removed when a PropertyNotify event
+ * reports that the property changed.
+ */
+typedef struct prop_cache_t {
+    cached_prop_t *props;
+    int count;
+    int capacity;
+} prop_cache_t;
+
+/*
+ * A window that matched no rule. The entry is only trusted while the
+ * rules have not been reloaded since, ie while the generation matches.
+ */
+typedef struct negative_match_t {
+    /* the rule set generation the window was matched against */
+    unsigned int generation;
+} negative_match_t;
+
+/*
+ * A new window whose matching has been deferred. The window is matched
+ * when it is mapped, when one of the rule properties changes, or when
+ * the deadline passes, whichever comes first.
+ */
+typedef struct pending_match_t {
+    /* the time of the deferred match in milliseconds */
+    uint64_t deadline;
+} pending_match_t;
+
+/*
+ * A checked request whose error, if any, has not been collected yet. The
+ * description and window are used to log the error.
+ */
+typedef struct checked_request_t {
+    unsigned int sequence;
+    const char *what;
+    xcb_window_t win;
+} checked_request_t;
+
+/*
+ * The X events read in one pass of the monitor loop, which are handled
+ * together.
+ */
+typedef struct event_batch_t {
+    xcb_generic_event_t **events;
+    int count;
+    int capacity;
+} event_batch_t;
+
+/*
+ * Windows found by the tree scan along with the anchor and the top-level
+ * window of each one, which the scan knows without asking the server. The
+ * anchor is the nearest ancestor that is checked against the rules, or 0.
+ * The three arrays are kept in step.
+ */
+typedef struct scan_list_t {
+    win_array_t wins;
+    win_array_t anchors;
+    win_array_t tops;
+} scan_list_t;
+
+/*
+ * Convenience object for initializing empty scan lists.
+ */
+static const scan_list_t EMPTY_SCAN_LIST = { { NULL, 0, 0 }, { NULL, 0, 0 }, { NULL, 0, 0 } };
+
+/* The steps of an asynchronous window evaluation */
+typedef enum eval_state_t {
+    /* waiting for a free slot */
+    EVAL_QUEUED,
+
+    /* waiting for the replies to the property requests */
+    EVAL_PROPERTIES,
+
+    /* waiting for the reply to a parent query */
+    EVAL_PARENT
+} eval_state_t;
+
+/*
+ * The state of an asynchronous evaluation of a window against the rules
+ * while monitoring. The requests of each step are sent when the step
+ * begins and their replies are polled for, so that many windows can be
+ * evaluated at once without waiting on any of them.
+ */
+typedef struct eval_ctx_t {
+    /* the window being evaluated */
+    xcb_window_t win;
+
+    /* the current step */
+    eval_state_t state;
+
+    /* the property requests, one per rule set atom, and which are in flight */
+    int atom_count;
+    xcb_get_property_cookie_t *cookies;
+    bool *waiting;
+    int outstanding;
+
+    /* the index of the rule the window matched */
+    int idx;
+
+    /* the parent query in flight and the window it is for */
+    xcb_query_tree_cookie_t tree_cookie;
+    xcb_window_t querying;
+
+    /* the window the parent chain is followed from and the top-level window found */
+    xcb_window_t walk_from;
+    xcb_window_t target;
+
+    /* whether the top-level window of a tracked window is looked up again */
+    bool retarget;
+} eval_ctx_t;
 
 /* ################ Helper functions ################### */
 
 /*
- * Returns an atom for the given name.
+ * Returns an atom for the given name. If only_if_exists is true, the atom
+ * is not created and XCB_ATOM_NONE is returned if it does not exist.
  */
 static xcb_atom_t
-atom_for_name( ghost_t *ghost, const char *name)
+atom_for_name( ghost_t *ghost, const char *name, bool only_if_exists )
 {
     xcb_intern_atom_cookie_t cookie;
     xcb_intern_atom_reply_t *reply;
     xcb_atom_t result;
 
     cookie = xcb_intern_atom( ghost->conn,
-                              0, /* only_if_exists; set to false to create the atom if needed */
+                              only_if_exists, /* only_if_exists; set to false to create the atom if needed */
                               strlen(name), /* data length */
                               name	/* the data */
                             );
@@ -47,570 +214,2741 @@ atom_for_name( ghost_t *ghost, const char *name)
 }
 
 /*
- * Applies the given float opacity to the window.
+ * Remembers the given checked request so that its error, if any, is
+ * logged by collect_request_errors(). what describes the request.
  */
 static void
-apply_opacity( ghost_t *ghost, ght_window_t *win, double opacity )
+track_request( ghost_t *ghost, xcb_void_cookie_t cookie, const char *what, xcb_window_t win )
 {
-    uint32_t val = (uint32_t) (opacity * OPAQUE);
+    checked_request_t *req;
 
-    info( "[apply_opacity] Setting opacity for window 0x%x to %.2f\n", win->target_win, opacity );
+    if ( ghost->checked_count == ghost->checked_capacity ) {
+        ghost->checked_capacity = ghost->checked_capacity > 0 ? ghost->checked_capacity * 2 : 16;
+        ghost->checked_requests = checked_realloc( ghost->checked_requests,
+                                                   ghost->checked_capacity
+                                                   * sizeof( checked_request_t ));
+    }
 
-    xcb_change_property( ghost->conn, /* connection */
-                         XCB_PROP_MODE_REPLACE,	/* mode */
-                         win->target_win,	/* window */
-                         ghost->opacity_atom, /* atom to change */
-                         XCB_ATOM_CARDINAL,	/* property type */
-                         32,	/* format, meaning whether the data should be considered as a list of 8-bit, 16-bit, or 32-bit quantities */
-                         1,	/* data length */
-                         (unsigned char *) &val	/* the data for the property */
-                       );
-    xcb_flush( ghost->conn );
+    req = ghost->checked_requests + ghost->checked_count++;
+    req->sequence = cookie.sequence;
+    req->what = what;
+    req->win = win;
 }
 
 /*
- * Returns a string property for the given window. The returned string must be
- * freed by the caller.
+ * Logs and frees the error of the given checked request, if any. Windows
+ * are often destroyed before requests about them arrive, so BadWindow
+ * errors are only logged as debug messages.
  */
-static char *
-get_string_property( ghost_t *ghost, xcb_window_t win, xcb_atom_t prop)
+static void
+log_request_error( checked_request_t *req, xcb_generic_error_t *err )
 {
-    xcb_get_property_cookie_t prop_cookie;
-    xcb_get_property_reply_t *reply;
-    void *data;
-    int len;
-    char *result;
-
-    prop_cookie = xcb_get_property( ghost->conn,
-                                    0, /* delete */
-                                    win,	/* the window */
-                                    prop,	/* the property */
-                                    XCB_ATOM_STRING, /* the property type */
-                                    0,	/* data offset */
-                                    MAX_STR_LEN /* the max length of the data */
-                                  );
-
-    xcb_flush( ghost->conn );
-
-    reply = xcb_get_property_reply( ghost->conn,
-                                    prop_cookie, /* the cookie */
-                                    NULL	/* error pointer */
-                                  );
-
-    if ( !reply ) {
-        warn( "Unable to get property 0x%x from window 0x%x\n", prop, win);
-        return NULL;
-    }
-
-    if ( reply->type == XCB_ATOM_NONE ) {
-        free( reply );
-        return NULL;
+    if ( err == NULL ) {
+        return;
     }
 
-    data = xcb_get_property_value( reply );
-    len = xcb_get_property_value_length( reply );
-
-    if ( len < 1 ) {
-        return NULL;
+    if ( err->error_code == XCB_WINDOW ) {
+        debug( "[log_request_error] Window 0x%x is gone; unable to %s\n", req->win, req->what );
+    } else {
+        warn( "Unable to %s for window 0x%x: error %d\n", req->what, req->win, err->error_code );
     }
 
-    result = checked_malloc( len + 1 );
-
-    strncpy( result, data, len );
-
-    free( reply );
-
-    return result;
+    free( err );
 }
 
 /*
- * Returns the xcb_window_t with the current input focus or 0
- * if it cannot be determined.
+ * Logs the errors of the tracked requests that the server has already
+ * answered, without waiting for the others. Requests complete in order,
+ * so the first one still outstanding ends the search. If sync is true,
+ * a single round trip is made first so that every request is answered.
+ * Returns true if any request was found to be answered.
  */
-static xcb_window_t
-get_focused_window( ghost_t *ghost )
+static bool
+collect_request_errors( ghost_t *ghost, bool sync )
 {
-    xcb_get_input_focus_cookie_t cookie;
-    xcb_get_input_focus_reply_t *reply;
-    xcb_window_t focused_window;
-
-    cookie = xcb_get_input_focus( ghost->conn );
-
-    reply = xcb_get_input_focus_reply( ghost->conn, cookie, NULL );
+    checked_request_t *reqs = ghost->checked_requests;
+    xcb_generic_error_t *err;
+    xcb_void_cookie_t last;
+    void *reply;
+    int done;
+
+    if ( ghost->checked_count < 1 ) {
+        return false;
+    }
 
-    if ( !reply ) {
-        warn( "Unable to determine current focused window!\n" );
-        return 0;
+    if ( sync ) {
+        last.sequence = reqs[ghost->checked_count - 1].sequence;
+        err = xcb_request_check( ghost->conn, last );
+        log_request_error( reqs + ghost->checked_count - 1, err );
+        ghost->checked_count--;
     }
 
-    focused_window = reply->focus;
+    for ( done=0; done<ghost->checked_count; done++ ) {
+        reply = NULL;
+        err = NULL;
+        if ( !xcb_poll_for_reply( ghost->conn, reqs[done].sequence, &reply, &err )) {
+            break;
+        }
 
-    free( reply );
+        log_request_error( reqs + done, err );
+        free( reply );
+    }
 
-    debug( "[get_focused_window] Found focused window: 0x%x\n", focused_window );
+    if ( done > 0 ) {
+        memmove( reqs, reqs + done, ( ghost->checked_count - done ) * sizeof( checked_request_t ));
+        ghost->checked_count -= done;
+    }
 
-    return focused_window;
+    return sync || done > 0;
 }
 
 /*
- * Registers this client for events from the given window.
+ * Sends a request setting the given float opacity on the window. The
+ * request is not flushed. In streaming mode the request is unchecked, so
+ * that nothing is kept for each window written; its errors are dropped.
  */
 static void
-register_for_events( ghost_t *ghost, xcb_window_t win, uint32_t events )
+send_opacity( ghost_t *ghost, xcb_window_t target, double opacity )
 {
-    uint32_t values[1];
-    values[0] = events;
-
-    xcb_change_window_attributes( ghost->conn, win, XCB_CW_EVENT_MASK, values );
-    xcb_flush( ghost->conn );
+    uint32_t val = OPACITY_VALUE( opacity );
+    xcb_void_cookie_t cookie;
+
+    info( "[send_opacity] Setting opacity for window 0x%x to %.2f\n", target, opacity );
+
+    cookie = ( ghost->streaming ? xcb_change_property
+                                : xcb_change_property_checked )(
+                 ghost->conn, /* connection */
+                 XCB_PROP_MODE_REPLACE,	/* mode */
+                 target,	/* window */
+                 ghost->opacity_atom, /* atom to change */
+                 XCB_ATOM_CARDINAL,	/* property type */
+                 32,	/* format, meaning whether the data should be considered as a list of 8-bit, 16-bit, or 32-bit quantities */
+                 1,	/* data length */
+                 (unsigned char *) &val	/* the data for the property */
+             );
+
+    if ( !ghost->streaming ) {
+        track_request( ghost, cookie, "set the opacity", target );
+    }
 }
 
 /*
- * Gets the highest parent window that is not the root
+ * Sends a request removing the opacity property from the window, which
+ * leaves it opaque. The request is not flushed.
  */
-static xcb_window_t
-get_top_window( ghost_t *ghost, xcb_window_t win )
+static void
+remove_opacity( ghost_t *ghost, xcb_window_t target )
 {
-    xcb_window_t current;
-    xcb_window_t parent;
-    xcb_window_t root;
-    xcb_query_tree_cookie_t tree_cookie;
-    xcb_query_tree_reply_t *reply;
-
-    current = win;
-    while ( 1 ) {
-        tree_cookie = xcb_query_tree( ghost->conn, current );
-        reply = xcb_query_tree_reply( ghost->conn,
-                                      tree_cookie,
-                                      NULL /* error pointer */
-                                    );
+    xcb_void_cookie_t cookie;
 
-        if ( !reply ) {
-            error( "Failed to query tree for window 0x%x\n", win );
-            return 0;
-        }
+    info( "[remove_opacity] Removing opacity from window 0x%x\n", target );
 
-        parent = reply->parent;
-        root = reply->root;
+    cookie = xcb_delete_property_checked( ghost->conn, target, ghost->opacity_atom );
+    track_request( ghost, cookie, "remove the opacity", target );
 
-        free( reply );
+    ght_map_remove( ghost->applied_opacity_map, &target );
+}
 
-        if ( !parent ) {
-            /* no parent window, this must be the root */
-            return 0;
-        } else if ( parent == root ) {
-            /* we found it! */
-            return current;
-        }
+/*
+ * Applies the given float opacity to the window. The request is not
+ * flushed, so that a whole round of changes goes out at once. Nothing is
+ * sent if the value last written to the target window is the same.
+ */
+static void
+apply_opacity( ghost_t *ghost, ght_window_t *win, double opacity )
+{
+    uint32_t val = OPACITY_VALUE( opacity );
+    map_entry_t *applied = ght_map_get_entry( ghost->applied_opacity_map, &(win->target_win) );
 
-        current = parent;
+    if ( applied != NULL && (uint32_t) (uintptr_t) applied->value == val ) {
+        ghost->opacity_writes_saved++;
+        return;
     }
 
-    return 0;
+    send_opacity( ghost, win->target_win, opacity );
+
+    ght_map_put( ghost->applied_opacity_map, &(win->target_win), (void *) (uintptr_t) val );
 }
 
 /*
- * Checks the given window against the rule and returns a configured
- * ght_window_t pointer if the window matches the rule. The caller is responsible
- * for freeing the ght_window_t memory.
+ * Sends a request for a string property of the given window. The
+ * reply is read with read_string_property().
  */
-static ght_window_t *
-check_window_against_rule( ghost_t *ghost, xcb_window_t win, ght_rule_t *rule )
+static xcb_get_property_cookie_t
+request_string_property( ghost_t *ghost, xcb_window_t win, xcb_atom_t prop )
 {
-    /* go through each matcher in the rule to see if they all match */
-    char *win_value;
-    int matched = 0;
-
-    ght_matcher_t *matcher;
-    ght_list_for_each( &(rule->matchers), matcher, ght_matcher_t ) {
-        win_value = get_string_property( ghost,
-                                         win, matcher->name_atom );
+    return xcb_get_property( ghost->conn,
+                             0, /* delete */
+                             win,	/* the window */
+                             prop,	/* the property */
+                             XCB_ATOM_STRING, /* the property type */
+                             0,	/* data offset */
+                             MAX_STR_LEN /* the max length of the data */
+                           );
+}
 
-        /* don't consider case in string compares here */
-        matched = win_value != NULL
-                  && strncasecmp( win_value, matcher->value, MAX_STR_LEN ) == 0;
+/*
+ * Points value at the property data within the given string property
+ * reply, without copying it. The reply is returned and must be freed by
+ * the caller once the value is no longer needed. If the reply is NULL or
+ * the window does not have the property, value->data is set to NULL, the
+ * reply is freed and NULL is returned.
+ */
+static xcb_get_property_reply_t *
+take_string_value( xcb_get_property_reply_t *reply, ght_value_t *value )
+{
+    value->data = NULL;
+    value->len = 0;
 
-        free( win_value );
+    if ( !reply ) {
+        return NULL;
+    }
 
-        if ( !matched ) {
-            return NULL;
-        }
+    if ( reply->type == XCB_ATOM_NONE
+            || xcb_get_property_value_length( reply ) < 1 ) {
+        free( reply );
+        return NULL;
     }
 
-    /* This window matched all values! Create a ghost window struct. */
-    ght_window_t *ght_win = checked_malloc( sizeof( ght_window_t ));
-    ght_win->win = win;
-    ght_win->target_win = get_top_window( ghost, win );
-    ght_win->focus_opacity = rule->focus_opacity;
-    ght_win->normal_opacity = rule->normal_opacity;
+    value->data = xcb_get_property_value( reply );
+    value->len = xcb_get_property_value_length( reply );
 
-    return ght_win;
+    return reply;
 }
 
 /*
- * Returns a new ght_window_t if this window matches one of the configured
- * rules.
+ * Reads the reply to a request made with request_string_property() and
+ * points value at the property data within the reply, as described for
+ * take_string_value().
  */
-static ght_window_t *
-check_window( ghost_t *ghost, xcb_window_t win )
+static xcb_get_property_reply_t *
+read_string_property( ghost_t *ghost, xcb_window_t win, xcb_atom_t prop,
+                      xcb_get_property_cookie_t prop_cookie, ght_value_t *value )
 {
-    /* find the first rule that matches */
-    ght_window_t *ght_win;
-    int idx = 0;
-    ght_rule_t *rule;
-    ght_list_for_each( &(ghost->rules), rule, ght_rule_t ) {
-        ght_win = check_window_against_rule( ghost, win, rule );
-        if ( ght_win != NULL ) {
-            debug( "[check_window] Found rule match for window 0x%x at rule index %d: "
-                   "normal=%.2f, focus=%.2f\n",
-                   win, idx,
-                   ght_win->normal_opacity,
-                   ght_win->focus_opacity );
+    xcb_get_property_reply_t *reply;
 
-            return ght_win;
-        }
+    reply = xcb_get_property_reply( ghost->conn,
+                                    prop_cookie, /* the cookie */
+                                    NULL	/* error pointer */
+                                  );
 
-        ++idx;
+    if ( !reply ) {
+        warn( "Unable to get property 0x%x from window 0x%x\n", prop, win);
     }
 
-    return NULL;
+    return take_string_value( reply, value );
 }
 
 /*
- * Returns the ght_window_t with the given xcb window id or NULL if not found.
+ * Returns the cached property with the given atom or NULL if the
+ * property is not cached.
  */
-static ght_window_t *
-find_window( ghost_t *ghost, xcb_window_t win )
+static cached_prop_t *
+find_cached_prop( prop_cache_t *cache, xcb_atom_t atom )
 {
-    return (ght_window_t *) ght_map_get( ghost->win_map, &win );
+    int i;
+    for ( i=0; i<cache->count; i++ ) {
+        if ( cache->props[i].atom == atom ) {
+            return cache->props + i;
+        }
+    }
+    return NULL;
 }
 
 /*
- * Returns the ght_window_t with the given xcb target window or NULL if not found.
- * ght_window_t *.
+ * Appends an entry for the given atom to the cache and returns it. This
+ * may move the existing entries.
  */
-static ght_window_t *
-find_window_by_target( ghost_t *ghost, xcb_window_t target )
+static cached_prop_t *
+add_cached_prop( prop_cache_t *cache, xcb_atom_t atom )
 {
-    return (ght_window_t *) ght_map_get( ghost->target_win_map, &target );
+    cached_prop_t *prop;
+
+    if ( cache->count == cache->capacity ) {
+        cache->capacity = cache->capacity > 0 ? cache->capacity * 2 : 4;
+        cache->props = checked_realloc( cache->props,
+                                        cache->capacity * sizeof( cached_prop_t ));
+    }
+
+    prop = cache->props + cache->count++;
+    prop->atom = atom;
+    prop->reply = NULL;
+    prop->value.data = NULL;
+    prop->value.len = 0;
+
+    return prop;
 }
 
 /*
- * Removes the given ght_window_t from the lookup maps and frees its memory.
+ * Removes the cached property with the given atom, if present. Returns
+ * true if an entry was removed.
  */
-static void
-untrack_window( ghost_t *ghost, ght_window_t *ght_win )
+static bool
+invalidate_cached_prop( prop_cache_t *cache, xcb_atom_t atom )
 {
-    if ( ght_win == NULL ) {
-        return;
+    cached_prop_t *prop = find_cached_prop( cache, atom );
+    if ( prop == NULL ) {
+        return false;
     }
 
-    info( "[untrack_window] Untracking window: win= 0x%x, target_win= 0x%x\n",
-          ght_win->win, ght_win->target_win );
-
-    /* remove the window from the target map */
-    ght_map_remove( ghost->target_win_map, &(ght_win->target_win));
+    free( prop->reply );
 
-    /* remove the window from the win map */
-    ght_map_remove( ghost->win_map, &(ght_win->win));
+    /* the order of the entries does not matter */
+    *prop = cache->props[--cache->count];
 
-    /* free the window memory */
-    free( ght_win );
+    return true;
 }
 
 /*
- * Adds the given ght_window_t to the tracked window maps, freeing any
- * previous entry that may have been there.
+ * Frees the given property cache and all of its replies.
  */
 static void
-track_window( ghost_t *ghost, ght_window_t *ght_win )
+free_prop_cache( prop_cache_t *cache )
 {
-    if ( ght_win == NULL ) {
+    int i;
+
+    if ( cache == NULL ) {
         return;
     }
 
-    info("[track_window] Adding window to tracked list: "
-          "win=0x%x, target_win=0x%x, "
-          "normal_opacity=%.2f, focus_opacity=%.2f\n",
-          ght_win->win, ght_win->target_win,
-          ght_win->normal_opacity, ght_win->focus_opacity );
-
-    ght_window_t *prev = ght_map_put( ghost->win_map,
-                                      &(ght_win->win),
-                                      ght_win );
-
-    /* free the previous version if we had one */
-    if ( prev != NULL ) {
-        ght_map_remove( ghost->target_win_map,
-                        &(prev->target_win));
-        free( prev );
+    for ( i=0; i<cache->count; i++ ) {
+        free( cache->props[i].reply );
     }
-
-    /* add this entry to the parent window map */
-    ght_map_put( ghost->target_win_map,
-                 &(ght_win->target_win),
-                 ght_win );
+    free( cache->props );
+    free( cache );
 }
 
 /*
- * Changes the parent/target window of the ght_window_t, updating the lookup maps
- * as needed.
+ * Releases the memory of the given evaluation.
  */
 static void
-reparent_window( ghost_t *ghost, ght_window_t *ght_win, xcb_window_t new_parent )
+free_evaluation( eval_ctx_t *ctx )
 {
-    if ( ght_win == NULL ) {
-        return;
-    }
-
-    xcb_window_t old_parent = ght_win->target_win;
-
-    /* remove the old entry */
-    ght_map_remove( ghost->target_win_map, &(ght_win->target_win));
-
-    /* set the new value */
-    ght_win->target_win = new_parent;
-
-    /* add the new entry to the target lookup map */
-    ght_map_put( ghost->target_win_map, &new_parent, ght_win );
-
-    info( "[reparent_window] Reparented window 0x%x: old parent= 0x%x, new parent= 0x%x\n",
-          ght_win->win, old_parent, new_parent );
+    free( ctx->cookies );
+    free( ctx->waiting );
+    free( ctx );
 }
 
 /*
- * Checks the given window and all child windows recursively.
+ * Removes and frees the property cache of the given window, if it has one.
  */
 static void
-load_windows_recursive( ghost_t *ghost, xcb_window_t win )
+drop_prop_cache( ghost_t *ghost, xcb_window_t win )
 {
-    xcb_query_tree_cookie_t tree_cookie;
-    xcb_query_tree_reply_t *reply;
-    int child_count;
-    xcb_window_t *child;
+    free_prop_cache( ght_map_remove( ghost->prop_cache, &win ));
+}
 
-    /* check this window */
-    ght_window_t *ght_win = check_window( ghost, win );
-    if ( ght_win != NULL ) {
-        /* start tracking the window */
-        track_window( ghost, ght_win );
+/*
+ * Removes and frees every property cache.
+ */
+static void
+clear_prop_caches( ghost_t *ghost )
+{
+    map_entry_t *entry;
+    map_iter_t iter;
+    ght_map_for_each_entry( ghost->prop_cache, &iter, entry ) {
+        free_prop_cache( entry->value );
+        ght_map_remove_entry( ghost->prop_cache, entry );
     }
+}
 
-    /* visit the child windows */
-    tree_cookie = xcb_query_tree( ghost->conn, win );
-
-    reply = xcb_query_tree_reply( ghost->conn,
-                                  tree_cookie,
-                                  NULL /* error pointer */
-                                );
-
-    if ( !reply ) {
-        error( "Failed to query tree for window 0x%x\n", win );
-        return;
+/*
+ * Returns the xcb_window_t with the current input focus or 0
+ * if it cannot be determined.
+ */
+static xcb_window_t
+get_focused_window( ghost_t *ghost )
+{
+    xcb_get_input_focus_cookie_t cookie;
+    xcb_get_input_focus_reply_t *reply;
+    xcb_window_t focused_window;
+
+    cookie = xcb_get_input_focus( ghost->conn );
+
+    reply = xcb_get_input_focus_reply( ghost->conn, cookie, NULL );
+
+    if ( !reply ) {
+        warn( "Unable to determine current focused window!\n" );
+        return 0;
+    }
+
+    focused_window = reply->focus;
+
+    free( reply );
+
+    debug( "[get_focused_window] Found focused window: 0x%x\n", focused_window );
+
+    return focused_window;
+}
+
+/*
+ * Registers this client for events from the given window. The request is
+ * not flushed.
+ */
+static void
+register_for_events( ghost_t *ghost, xcb_window_t win, uint32_t events )
+{
+    xcb_void_cookie_t cookie;
+    uint32_t values[1];
+    values[0] = events;
+
+    cookie = xcb_change_window_attributes_checked( ghost->conn, win, XCB_CW_EVENT_MASK, values );
+    track_request( ghost, cookie, "select events", win );
+}
+
+/*
+ * Records the parent of the given window in the parent map. The parent
+ * is stored directly in the map value rather than in separate memory.
+ */
+static void
+set_parent( ghost_t *ghost, xcb_window_t win, xcb_window_t parent )
+{
+    if ( ght_map_put( ghost->parent_map, &win, (void *) (uintptr_t) parent ) == NULL ) {
+        ghost->parent_count++;
+    }
+}
+
+/*
+ * Returns the parent of the given window recorded in the parent map
+ * or 0 if it is not known.
+ */
+static xcb_window_t
+lookup_parent( ghost_t *ghost, xcb_window_t win )
+{
+    return (xcb_window_t) (uintptr_t) ght_map_get( ghost->parent_map, &win );
+}
+
+/*
+ * Returns true if a change of the given parent of the window would be
+ * reported to us. While monitoring, only links to the root window and
+ * links of watched windows are reported, through the root window's
+ * SubstructureNotify and the watched window's own events. Every link is
+ * trusted while loading, since the scan has just filled the map.
+ */
+static bool
+parent_link_reported( ghost_t *ghost, xcb_window_t win, xcb_window_t parent )
+{
+    return !ghost->monitoring
+        || parent == ghost->winroot
+        || ght_map_get_entry( ghost->prop_cache, &win ) != NULL
+        || ght_map_get_entry( ghost->pending_map, &win ) != NULL;
+}
+
+/*
+ * Returns the parent of the given window recorded in the parent map if
+ * the link can be trusted, or 0 if it must be confirmed with the server.
+ */
+static xcb_window_t
+known_parent( ghost_t *ghost, xcb_window_t win )
+{
+    xcb_window_t parent = lookup_parent( ghost, win );
+
+    if ( parent && !parent_link_reported( ghost, win, parent )) {
+        return 0;
+    }
+    return parent;
+}
+
+/*
+ * Removes the given destroyed window from the parent map. The entries of
+ * its descendants are left behind: watched descendants report their own
+ * destruction, the links of the others are confirmed with the server
+ * before they are used, and prune_parent_map() removes them eventually.
+ */
+static void
+forget_parent( ghost_t *ghost, xcb_window_t win )
+{
+    if ( ght_map_remove( ghost->parent_map, &win ) != NULL ) {
+        ghost->parent_count--;
+    }
+}
+
+/*
+ * Gets the highest parent window that is not the root by following the
+ * parent map, which is filled by the window scan and by structure events.
+ * This never costs a round trip: 0 is returned if the chain reaches a
+ * window whose parent is not known or whose link would not be reported
+ * to us, in which case the chain has to be walked by an evaluation.
+ */
+static xcb_window_t
+known_top_window( ghost_t *ghost, xcb_window_t win )
+{
+    xcb_window_t current = win;
+    xcb_window_t parent;
+
+    while (( parent = known_parent( ghost, current )) && parent != ghost->winroot ) {
+        current = parent;
+    }
+
+    return parent == ghost->winroot ? current : 0;
+}
+
+/*
+ * Fills in the given parent map for the parent chains of the given
+ * windows. The xcb_query_tree requests for every window whose parent is
+ * unknown are sent before any reply is read, so this costs one round trip
+ * per tree level that is missing from the map rather than one per window.
+ */
+static void
+resolve_parents( ghost_t *ghost, map_t *parents, win_array_t *wins )
+{
+    win_array_t unknown = EMPTY_WIN_ARRAY;
+    xcb_query_tree_cookie_t *cookies = NULL;
+    xcb_query_tree_reply_t *reply;
+    xcb_window_t cur, parent;
+    bool progress = true;
+    int i;
+
+    while ( progress ) {
+        progress = false;
+
+        /* find the highest window of each chain with an unknown parent */
+        ght_win_array_clear( &unknown );
+        for ( i=0; i<wins->count; i++ ) {
+            cur = wins->items[i];
+            while ( cur != ghost->winroot
+                    && ( parent = (xcb_window_t) (uintptr_t) ght_map_get( parents, &cur ))) {
+                cur = parent;
+            }
+            if ( cur != ghost->winroot ) {
+                ght_win_array_push( &unknown, cur );
+            }
+        }
+
+        if ( unknown.count < 1 ) {
+            break;
+        }
+
+        cookies = checked_realloc( cookies, unknown.count * sizeof( xcb_query_tree_cookie_t ));
+        for ( i=0; i<unknown.count; i++ ) {
+            cookies[i] = xcb_query_tree( ghost->conn, unknown.items[i] );
+        }
+
+        for ( i=0; i<unknown.count; i++ ) {
+            reply = xcb_query_tree_reply( ghost->conn, cookies[i], NULL );
+            if ( reply && reply->parent ) {
+                if ( parents == ghost->parent_map ) {
+                    /* keep the parent count in step */
+                    set_parent( ghost, unknown.items[i], reply->parent );
+                } else {
+                    ght_map_put( parents, &(unknown.items[i]), (void *) (uintptr_t) reply->parent );
+                }
+                progress = true;
+            }
+            free( reply );
+        }
+    }
+
+    ght_win_array_free( &unknown );
+    free( cookies );
+}
+
+/*
+ * Returns the highest window below the root on the parent chain of the
+ * given window as recorded in the given parent map, or 0 if the chain
+ * does not reach the root window. No requests are sent.
+ */
+static xcb_window_t
+find_top_window( ghost_t *ghost, map_t *parents, xcb_window_t win )
+{
+    xcb_window_t cur = win;
+    xcb_window_t parent;
+
+    while (( parent = (xcb_window_t) (uintptr_t) ght_map_get( parents, &cur ))
+            && parent != ghost->winroot ) {
+        cur = parent;
+    }
+
+    return parent == ghost->winroot ? cur : 0;
+}
+
+/*
+ * Adds the given window and its parent chain as recorded in the parent
+ * map to the needed set.
+ */
+static void
+mark_parent_chain( ghost_t *ghost, map_t *needed, xcb_window_t win )
+{
+    xcb_window_t cur = win;
+
+    while ( cur && ght_map_get_entry( needed, &cur ) == NULL ) {
+        ght_map_put( needed, &cur, NULL );
+        cur = lookup_parent( ghost, cur );
+    }
+}
+
+/*
+ * Removes parent map entries that are not on the parent chain of a
+ * window whose properties are cached or pending, ie a tracked or watched
+ * window. Those are the only chains the top-level lookups need, and other
+ * entries could outlive their windows since their destruction is not
+ * reported.
+ */
+static void
+prune_parent_map( ghost_t *ghost )
+{
+    map_t *needed = ght_winmap_create( MAP_SIZE_LG );
+    map_entry_t *entry;
+    map_iter_t iter;
+
+    ght_map_for_each_entry( ghost->prop_cache, &iter, entry ) {
+        mark_parent_chain( ghost, needed, *((xcb_window_t *) entry->key) );
+    }
+    ght_map_for_each_entry( ghost->pending_map, &iter, entry ) {
+        mark_parent_chain( ghost, needed, *((xcb_window_t *) entry->key) );
+    }
+
+    ghost->parent_count = 0;
+    ght_map_for_each_entry( ghost->parent_map, &iter, entry ) {
+        if ( ght_map_get_entry( needed, entry->key ) == NULL ) {
+            ght_map_remove_entry( ghost->parent_map, entry );
+        } else {
+            ghost->parent_count++;
+        }
+    }
+
+    ghost->parent_prune_at = ghost->parent_count > PARENT_PRUNE_MIN / 2 ? ghost->parent_count * 2
+                                                                        : PARENT_PRUNE_MIN;
+
+    ght_map_free( needed );
+}
+
+/*
+ * Forgets that the given window matched no rule.
+ */
+static void
+drop_negative_match( ghost_t *ghost, xcb_window_t win )
+{
+    free( ght_map_remove( ghost->negative_cache, &win ));
+}
+
+/*
+ * Returns true if the given window is recorded as matching no rule
+ * under the current rules. Records from older rules are removed.
+ */
+static bool
+is_known_nonmatching( ghost_t *ghost, xcb_window_t win )
+{
+    negative_match_t *negative = ght_map_get( ghost->negative_cache, &win );
+
+    if ( negative == NULL ) {
+        return false;
+    }
+
+    if ( negative->generation != ghost->rule_generation ) {
+        /* the rules changed since */
+        drop_negative_match( ghost, win );
+        return false;
+    }
+
+    debug( "[is_known_nonmatching] Window 0x%x is known not to match\n", win );
+    return true;
+}
+
+/*
+ * Returns the property cache of the given window, creating it if needed.
+ */
+static prop_cache_t *
+ensure_prop_cache( ghost_t *ghost, xcb_window_t win )
+{
+    prop_cache_t *cache = ght_map_get( ghost->prop_cache, &win );
+
+    if ( cache == NULL ) {
+        cache = checked_malloc( sizeof( prop_cache_t ));
+        ght_map_put( ghost->prop_cache, &win, cache );
+    }
+
+    return cache;
+}
+
+/*
+ * Sends a request for every rule set property of the given window that is
+ * not in the given cache, which may be NULL, without reading any reply.
+ * The cookies are stored in cookies and sent[i] is set for each request
+ * sent, both indexed like the rule set atoms. Properties whose atom does
+ * not exist are never requested; they are added to the cache as missing
+ * instead. Returns the number of requests sent.
+ */
+static int
+request_match_properties( ghost_t *ghost, xcb_window_t win, prop_cache_t *cache,
+                          xcb_get_property_cookie_t *cookies, bool *sent )
+{
+    int atom_count = ghost->ruleset->atom_count;
+    xcb_atom_t *atoms = ghost->ruleset->atoms;
+    int requested = 0;
+    int a;
+
+    for ( a=0; a<atom_count; a++ ) {
+        sent[a] = false;
+
+        if ( cache != NULL && find_cached_prop( cache, atoms[a] ) != NULL ) {
+            continue;
+        }
+
+        if ( atoms[a] == XCB_ATOM_NONE ) {
+            /* no window can have a property that does not exist */
+            if ( cache != NULL ) {
+                add_cached_prop( cache, atoms[a] );
+            }
+            continue;
+        }
+
+        cookies[a] = request_string_property( ghost, win, atoms[a] );
+        sent[a] = true;
+        requested++;
+    }
+
+    return requested;
+}
+
+/*
+ * Makes sure every atom in the rule set is in the property caches of the
+ * given windows, creating the caches as needed. Windows known not to match
+ * are skipped. The requests for every missing property of every window are
+ * sent before any reply is read, so the whole batch costs at most a single
+ * round trip, and none at all if everything is cached.
+ */
+static void
+prefetch_match_properties( ghost_t *ghost, xcb_window_t *wins, int count )
+{
+    int atom_count = ghost->ruleset->atom_count;
+    xcb_atom_t *atoms = ghost->ruleset->atoms;
+    xcb_get_property_cookie_t *cookies;
+    bool *pending;
+    prop_cache_t *cache;
+    cached_prop_t *prop;
+    int requested = 0;
+    int i, a, n;
+
+    cookies = checked_malloc( count * atom_count * sizeof( xcb_get_property_cookie_t ) + 1 );
+    pending = checked_malloc( count * atom_count * sizeof( bool ) + 1 );
+
+    for ( i=0; i<count; i++ ) {
+        if ( is_known_nonmatching( ghost, wins[i] )) {
+            memset( pending + i * atom_count, 0, atom_count * sizeof( bool ));
+            continue;
+        }
+
+        requested += request_match_properties( ghost, wins[i], ensure_prop_cache( ghost, wins[i] ),
+                                               cookies + i * atom_count,
+                                               pending + i * atom_count );
+    }
+
+    for ( i=0; i<count && requested > 0; i++ ) {
+        cache = ght_map_get( ghost->prop_cache, &(wins[i]) );
+
+        for ( a=0; a<atom_count; a++ ) {
+            n = i * atom_count + a;
+            if ( pending[n] ) {
+                prop = add_cached_prop( cache, atoms[a] );
+                prop->reply = read_string_property( ghost, wins[i], atoms[a], cookies[n],
+                                                    &(prop->value) );
+            }
+        }
+    }
+
+    debug( "[prefetch_match_properties] Requested %d properties for %d windows\n",
+           requested, count );
+
+    free( cookies );
+    free( pending );
+}
+
+/*
+ * Fetches the value of every atom in the rule set from the given window
+ * into values, using the property cache where possible. The values point
+ * into the cached replies and stay valid until the cache is modified.
+ */
+static void
+fetch_match_properties( ghost_t *ghost, xcb_window_t win, ght_value_t *values )
+{
+    prop_cache_t *cache;
+    int i;
+
+    prefetch_match_properties( ghost, &win, 1 );
+
+    cache = ght_map_get( ghost->prop_cache, &win );
+    for ( i=0; i<ghost->ruleset->atom_count; i++ ) {
+        values[i] = find_cached_prop( cache, ghost->ruleset->atoms[i] )->value;
+    }
+}
+
+/*
+ * Returns the index of the first rule that matches the given window or
+ * GHT_NO_RULE. The properties used by the rules are fetched from the window
+ * once and the first matching rule is looked up in the compiled rule set.
+ *
+ * The fetched properties are kept in the property cache, so that matching
+ * the window again costs no round trips until a property changes, if the
+ * window matched, has any of the properties, or is watched for property
+ * changes. Other windows are not expected to match later and their
+ * properties are dropped.
+ *
+ * Kept windows that match no rule are also recorded in the negative match
+ * cache so that checking them again, until a property changes or the rules
+ * are reloaded, costs a single map lookup.
+ */
+static int
+match_window( ghost_t *ghost, xcb_window_t win, bool watched )
+{
+    negative_match_t *negative;
+    bool has_props = false;
+    int idx, i;
+
+    if ( ghost->ruleset == NULL || ghost->ruleset->atom_count < 1
+            || is_known_nonmatching( ghost, win )) {
+        return GHT_NO_RULE;
+    }
+
+    ght_value_t values[ghost->ruleset->atom_count];
+
+    /* find the first rule that matches */
+    fetch_match_properties( ghost, win, values );
+    idx = ght_ruleset_match( ghost->ruleset, values );
+
+    for ( i=0; i<ghost->ruleset->atom_count; i++ ) {
+        has_props |= values[i].data != NULL;
+    }
+
+    if ( idx == GHT_NO_RULE ) {
+        if ( has_props || watched ) {
+            negative = checked_malloc( sizeof( negative_match_t ));
+            negative->generation = ghost->rule_generation;
+            ght_map_put( ghost->negative_cache, &win, negative );
+        } else {
+            drop_prop_cache( ghost, win );
+        }
+    }
+
+    return idx;
+}
+
+/*
+ * Checks the given windows against the rules without caching anything,
+ * storing the index of the rule each window matches, or GHT_NO_RULE, in
+ * rules. The requests for every property of every window are sent before
+ * any reply is read, and each reply is freed as soon as its window has
+ * been checked.
+ */
+static void
+stream_match_windows( ghost_t *ghost, xcb_window_t *wins, int count, int *rules )
+{
+    int atom_count = ghost->ruleset->atom_count;
+    xcb_atom_t *atoms = ghost->ruleset->atoms;
+    xcb_get_property_cookie_t *cookies;
+    xcb_get_property_reply_t *replies[atom_count];
+    ght_value_t values[atom_count];
+    bool *sent;
+    int i, a, n;
+
+    cookies = checked_malloc( count * atom_count * sizeof( xcb_get_property_cookie_t ));
+    sent = checked_malloc( count * atom_count * sizeof( bool ));
+
+    for ( i=0; i<count; i++ ) {
+        request_match_properties( ghost, wins[i], NULL,
+                                  cookies + i * atom_count, sent + i * atom_count );
+    }
+
+    for ( i=0; i<count; i++ ) {
+        for ( a=0; a<atom_count; a++ ) {
+            n = i * atom_count + a;
+            if ( sent[n] ) {
+                replies[a] = read_string_property( ghost, wins[i], atoms[a],
+                                                   cookies[n], &(values[a]) );
+            } else {
+                replies[a] = take_string_value( NULL, &(values[a]) );
+            }
+        }
+
+        rules[i] = ght_ruleset_match( ghost->ruleset, values );
+
+        for ( a=0; a<atom_count; a++ ) {
+            free( replies[a] );
+        }
+    }
+
+    free( cookies );
+    free( sent );
+}
+
+/*
+ * Returns a new ght_window_t for the given window and its top-level
+ * target window using the opacity settings of the rule at index idx.
+ */
+static ght_window_t *
+create_window( ghost_t *ghost, xcb_window_t win, xcb_window_t target, int idx )
+{
+    ght_window_t *ght_win = checked_malloc( sizeof( ght_window_t ));
+    ght_win->win = win;
+    ght_win->target_win = target;
+    ght_win->focus_opacity = ghost->ruleset->focus_opacity[idx];
+    ght_win->normal_opacity = ghost->ruleset->normal_opacity[idx];
+
+    debug( "[create_window] Found rule match for window 0x%x at rule index %d: "
+           "normal=%.2f, focus=%.2f\n",
+           win, idx,
+           ght_win->normal_opacity,
+           ght_win->focus_opacity );
+
+    return ght_win;
+}
+
+/*
+ * Returns the ght_window_t with the given xcb window id or NULL if not found.
+ */
+static ght_window_t *
+find_window( ghost_t *ghost, xcb_window_t win )
+{
+    return (ght_window_t *) ght_map_get( ghost->win_map, &win );
+}
+
+/*
+ * Returns the ght_window_t with the given xcb target window or NULL if not found.
+ * ght_window_t *.
+ */
+static ght_window_t *
+find_window_by_target( ghost_t *ghost, xcb_window_t target )
+{
+    return (ght_window_t *) ght_map_get( ghost->target_win_map, &target );
+}
+
+/*
+ * Removes the given ght_window_t from the lookup maps and frees its memory.
+ */
+static void
+untrack_window( ghost_t *ghost, ght_window_t *ght_win )
+{
+    if ( ght_win == NULL ) {
+        return;
+    }
+
+    info( "[untrack_window] Untracking window: win= 0x%x, target_win= 0x%x\n",
+          ght_win->win, ght_win->target_win );
+
+    /* remove the window from the target map */
+    ght_map_remove( ghost->target_win_map, &(ght_win->target_win));
+
+    /* remove the window from the win map */
+    ght_map_remove( ghost->win_map, &(ght_win->win));
+
+    /* free the window memory */
+    free( ght_win );
+}
+
+/*
+ * Adds the given ght_window_t to the tracked window maps, freeing any
+ * previous entry that may have been there.
+ */
+static void
+track_window( ghost_t *ghost, ght_window_t *ght_win )
+{
+    if ( ght_win == NULL ) {
+        return;
+    }
+
+    info("[track_window] Adding window to tracked list: "
+          "win=0x%x, target_win=0x%x, "
+          "normal_opacity=%.2f, focus_opacity=%.2f\n",
+          ght_win->win, ght_win->target_win,
+          ght_win->normal_opacity, ght_win->focus_opacity );
+
+    ght_window_t *prev = ght_map_put( ghost->win_map,
+                                      &(ght_win->win),
+                                      ght_win );
+
+    /* free the previous version if we had one */
+    if ( prev != NULL ) {
+        ght_map_remove( ghost->target_win_map,
+                        &(prev->target_win));
+        free( prev );
+    }
+
+    /* add this entry to the parent window map */
+    ght_map_put( ghost->target_win_map,
+                 &(ght_win->target_win),
+                 ght_win );
+}
+
+/*
+ * Returns the watch events to select on the given window. Windows whose
+ * parent is not known to be the root window select their structure
+ * events themselves.
+ */
+static uint32_t
+watch_events( ghost_t *ghost, xcb_window_t win )
+{
+    if ( lookup_parent( ghost, win ) == ghost->winroot ) {
+        return ROOT_CHILD_WATCH_EVENTS;
+    }
+    return WATCH_EVENTS;
+}
+
+/*
+ * Selects the union of the events the given window needs for each of its
+ * roles: the watch events if it is tracked or its properties are cached
+ * or pending, and focus changes if it is the target of a tracked window,
+ * unless the focus is followed through the root window's
+ * _NET_ACTIVE_WINDOW. Nothing is sent if that mask is already selected.
+ * The root window is skipped since its event mask is used for monitoring.
+ */
+static void
+update_window_events( ghost_t *ghost, xcb_window_t win )
+{
+    map_entry_t *selected;
+    uint32_t events = 0;
+
+    if ( win == ghost->winroot ) {
+        return;
+    }
+
+    if ( find_window( ghost, win ) != NULL
+            || ght_map_get_entry( ghost->prop_cache, &win ) != NULL
+            || ght_map_get_entry( ghost->pending_map, &win ) != NULL ) {
+        events |= watch_events( ghost, win );
+    }
+
+    if ( !ghost->use_active_window && find_window_by_target( ghost, win ) != NULL ) {
+        events |= XCB_EVENT_MASK_FOCUS_CHANGE;
+    }
+
+    selected = ght_map_get_entry( ghost->event_mask_map, &win );
+    if ( selected != NULL ? (uint32_t) (uintptr_t) selected->value == events : events == 0 ) {
+        return;
+    }
+
+    register_for_events( ghost, win, events );
+    if ( events == 0 ) {
+        ght_map_remove( ghost->event_mask_map, &win );
+    } else {
+        ght_map_put( ghost->event_mask_map, &win, (void *) (uintptr_t) events );
+    }
+}
+
+/*
+ * Registers for the events needed to monitor the given tracked window:
+ * the watch events, which keep its property cache valid, on the window
+ * itself and focus changes on its target window.
+ */
+static void
+register_window_events( ghost_t *ghost, ght_window_t *ght_win )
+{
+    update_window_events( ghost, ght_win->win );
+    if ( ght_win->target_win != ght_win->win ) {
+        update_window_events( ghost, ght_win->target_win );
+    }
+}
+
+/*
+ * Registers for the watch events of an untracked window so that it is
+ * matched again if one of its properties changes.
+ */
+static void
+watch_window( ghost_t *ghost, xcb_window_t win )
+{
+    update_window_events( ghost, win );
+}
+
+/*
+ * Removes cached properties that the current rule set does not use. Their
+ * changes are not tracked, so they could not be trusted by a later rule set.
+ */
+static void
+prune_prop_caches( ghost_t *ghost )
+{
+    prop_cache_t *cache;
+    map_iter_t iter;
+    int i;
+
+    ght_map_for_each( ghost->prop_cache, &iter, cache, prop_cache_t * ) {
+        i = 0;
+        while ( i < cache->count ) {
+            if ( ghost->ruleset == NULL
+                    || ght_ruleset_atom_index( ghost->ruleset, cache->props[i].atom ) < 0 ) {
+                /* the last entry is moved here, so check this index again */
+                invalidate_cached_prop( cache, cache->props[i].atom );
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+/*
+ * Changes the parent/target window of the ght_window_t, updating the lookup maps
+ * as needed.
+ */
+static void
+reparent_window( ghost_t *ghost, ght_window_t *ght_win, xcb_window_t new_parent )
+{
+    if ( ght_win == NULL ) {
+        return;
+    }
+
+    xcb_window_t old_parent = ght_win->target_win;
+
+    /* remove the old entry */
+    ght_map_remove( ghost->target_win_map, &(ght_win->target_win));
+
+    /* set the new value */
+    ght_win->target_win = new_parent;
+
+    /* add the new entry to the target lookup map */
+    ght_map_put( ghost->target_win_map, &new_parent, ght_win );
+
+    info( "[reparent_window] Reparented window 0x%x: old parent= 0x%x, new parent= 0x%x\n",
+          ght_win->win, old_parent, new_parent );
+}
+
+/*
+ * Returns true if the given tracked window has the input focus, as last
+ * recorded in ghost->focused_win.
+ */
+static bool
+is_focused( ghost_t *ghost, ght_window_t *ght_win )
+{
+    return ghost->focused_win != 0
+        && ( ghost->focused_win == ght_win->win
+             || ghost->focused_win == ght_win->target_win );
+}
+
+/*
+ * Finds the top-level window of each of the given windows, storing it in
+ * targets. In streaming mode the parents are resolved into a map that is
+ * freed before returning, so that nothing outlives the batch; otherwise
+ * they are recorded in the parent map for monitoring.
+ */
+static void
+find_top_windows( ghost_t *ghost, win_array_t *wins, xcb_window_t *targets )
+{
+    map_t *parents = ghost->streaming ? ght_winmap_create( MAP_SIZE_MD ) : ghost->parent_map;
+    int i;
+
+    resolve_parents( ghost, parents, wins );
+
+    for ( i=0; i<wins->count; i++ ) {
+        targets[i] = find_top_window( ghost, parents, wins->items[i] );
+    }
+
+    if ( ghost->streaming ) {
+        ght_map_free( parents );
+    }
+}
+
+/*
+ * Returns the number of windows whose requests may be in flight at once
+ * while loading windows, when each one needs per_window requests, so that
+ * no more than ghost->scan_max_requests are in flight. At least one window
+ * is always allowed.
+ */
+static int
+scan_batch_size( ghost_t *ghost, int per_window )
+{
+    int batch_size = ghost->scan_max_requests / ( per_window > 0 ? per_window : 1 );
+    return batch_size > 0 ? batch_size : 1;
+}
+
+/*
+ * Checks the given windows against the rules and starts tracking the
+ * ones that match. The properties of as many windows as
+ * ghost->scan_max_requests allows are fetched at once, and the parents
+ * of the matching windows are resolved together, so each batch costs a
+ * few round trips rather than a few per window. If tops is not NULL, it holds the top-level
+ * window of each window and no parents are resolved. If
+ * ghost->apply_on_load is set, the opacity of each matching window is
+ * applied as soon as it is tracked.
+ *
+ * If ghost->streaming is set, the matching windows are not tracked and
+ * nothing is cached; the normal opacity of each one is sent as soon as its
+ * match is resolved, without flushing.
+ *
+ * If found is not NULL, the matching windows are added to it.
+ */
+static void
+load_window_list( ghost_t *ghost, xcb_window_t *wins, xcb_window_t *tops,
+                  int count, win_array_t *found )
+{
+    win_array_t matched = EMPTY_WIN_ARRAY;
+    ght_window_t *ght_win;
+    xcb_window_t *targets;
+    int batch_size, start, n, i;
+    int *rules;
+
+    if ( ghost->ruleset == NULL || ghost->ruleset->atom_count < 1 ) {
+        return;
+    }
+
+    /* one property request per rule atom for each window */
+    batch_size = scan_batch_size( ghost, ghost->ruleset->atom_count );
+    rules = checked_malloc( batch_size * sizeof( int ));
+    targets = checked_malloc( batch_size * sizeof( xcb_window_t ));
+
+    for ( start=0; start<count; start+=batch_size ) {
+        n = count - start;
+        if ( n > batch_size ) {
+            n = batch_size;
+        }
+
+        if ( ghost->streaming ) {
+            stream_match_windows( ghost, wins + start, n, rules );
+        } else {
+            /*
+             * The server handles the requests in order, so selecting the
+             * watch events first means no property change can fall between
+             * the fetch and the watch.
+             */
+            for ( i=0; i<n && ghost->watch_on_load; i++ ) {
+                if ( !is_known_nonmatching( ghost, wins[start + i] )) {
+                    ensure_prop_cache( ghost, wins[start + i] );
+                    watch_window( ghost, wins[start + i] );
+                }
+            }
+
+            prefetch_match_properties( ghost, wins + start, n );
+
+            /*
+             * Only windows with a rule property are candidates worth
+             * watching; the others lose their cache here, and with it
+             * the watch events selected above.
+             */
+            for ( i=0; i<n; i++ ) {
+                rules[i] = match_window( ghost, wins[start + i], false );
+                if ( ghost->watch_on_load && rules[i] == GHT_NO_RULE
+                        && ght_map_get_entry( ghost->prop_cache, &(wins[start + i]) ) == NULL ) {
+                    update_window_events( ghost, wins[start + i] );
+                }
+            }
+        }
+
+        /* keep the matching windows; rules and targets stay in step with them */
+        ght_win_array_clear( &matched );
+        for ( i=0; i<n; i++ ) {
+            if ( rules[i] != GHT_NO_RULE ) {
+                rules[matched.count] = rules[i];
+                if ( tops != NULL ) {
+                    targets[matched.count] = tops[start + i];
+                }
+                ght_win_array_push( &matched, wins[start + i] );
+            }
+        }
+
+        if ( tops == NULL ) {
+            find_top_windows( ghost, &matched, targets );
+        }
+
+        if ( found != NULL ) {
+            ght_win_array_push_all( found, matched.items, matched.count );
+        }
+
+        for ( i=0; i<matched.count && ghost->streaming; i++ ) {
+            if ( targets[i] ) {
+                send_opacity( ghost, targets[i], ghost->ruleset->normal_opacity[rules[i]] );
+            }
+        }
+
+        for ( i=0; i<matched.count && !ghost->streaming; i++ ) {
+            ght_win = create_window( ghost, matched.items[i], targets[i], rules[i] );
+            track_window( ghost, ght_win );
+
+            if ( ghost->apply_on_load ) {
+                apply_opacity( ghost, ght_win,
+                               is_focused( ghost, ght_win ) ? ght_win->focus_opacity
+                                                            : ght_win->normal_opacity );
+            }
+        }
+    }
+
+    ght_win_array_free( &matched );
+    free( targets );
+    free( rules );
+}
+
+/*
+ * Adds the given window to the scan list along with its anchor and its
+ * top-level window.
+ */
+static void
+scan_list_push( scan_list_t *list, xcb_window_t win, xcb_window_t anchor, xcb_window_t top )
+{
+    ght_win_array_push( &(list->wins), win );
+    ght_win_array_push( &(list->anchors), anchor );
+    ght_win_array_push( &(list->tops), top );
+}
+
+/*
+ * Removes every window from the scan list.
+ */
+static void
+scan_list_clear( scan_list_t *list )
+{
+    ght_win_array_clear( &(list->wins) );
+    ght_win_array_clear( &(list->anchors) );
+    ght_win_array_clear( &(list->tops) );
+}
+
+/*
+ * Frees the memory held by the scan list.
+ */
+static void
+scan_list_free( scan_list_t *list )
+{
+    ght_win_array_free( &(list->wins) );
+    ght_win_array_free( &(list->anchors) );
+    ght_win_array_free( &(list->tops) );
+}
+
+/*
+ * Reads the xcb_query_tree reply for the given cookie and adds the
+ * children of the window, whose top-level window is top, to the children
+ * list in stacking order from top to bottom, with the given anchor. Unless
+ * ghost->streaming is set, the window is also recorded as the parent of
+ * each child in the parent map.
+ */
+static void
+collect_children( ghost_t *ghost, xcb_window_t win, xcb_window_t anchor, xcb_window_t top,
+                  xcb_query_tree_cookie_t cookie, scan_list_t *children )
+{
+    xcb_query_tree_reply_t *reply;
+    xcb_window_t *kids;
+    int count, i;
+
+    reply = xcb_query_tree_reply( ghost->conn,
+                                  cookie,
+                                  NULL /* error pointer */
+                                );
+
+    if ( !reply ) {
+        error( "Failed to query tree for window 0x%x\n", win );
+        return;
+    }
+
+    kids = xcb_query_tree_children( reply );
+    count = xcb_query_tree_children_length( reply );
+
+    /* the children are listed bottom to top; add the topmost first */
+    for ( i=count - 1; i>=0; i-- ) {
+        if ( !ghost->streaming ) {
+            set_parent( ghost, kids[i], win );
+        }
+
+        /* children of the root window are their own top-level windows */
+        scan_list_push( children, kids[i], anchor, win == ghost->winroot ? kids[i] : top );
+    }
+
+    free( reply );
+}
+
+/*
+ * Reads the xcb_get_window_attributes reply for the given cookie and
+ * returns true if the window should not be matched: windows that no longer
+ * exist and, unless ghost->match_all_windows is set, override-redirect
+ * windows (menus, tooltips and the like) and InputOnly windows, which
+ * cannot show an opacity. *map_state receives the map state of the window.
+ */
+static bool
+is_skipped_window( ghost_t *ghost, xcb_window_t win,
+                   xcb_get_window_attributes_cookie_t cookie, uint8_t *map_state )
+{
+    xcb_get_window_attributes_reply_t *reply;
+    bool skip;
+
+    reply = xcb_get_window_attributes_reply( ghost->conn,
+                                             cookie,
+                                             NULL /* error pointer */
+                                           );
+    if ( !reply ) {
+        *map_state = XCB_MAP_STATE_UNMAPPED;
+        return true;
+    }
+
+    *map_state = reply->map_state;
+
+    skip = !ghost->match_all_windows
+        && ( reply->override_redirect
+             || reply->_class == XCB_WINDOW_CLASS_INPUT_ONLY );
+
+    if ( skip ) {
+        debug( "[is_skipped_window] Skipping window 0x%x\n", win );
+    }
+
+    free( reply );
+
+    return skip;
+}
+
+/*
+ * Reads the list of windows in the given property of the root window into
+ * clients. Returns false if the root window does not have the property.
+ */
+static bool
+read_client_list( ghost_t *ghost, xcb_atom_t atom, win_array_t *clients )
+{
+    xcb_get_property_cookie_t cookie;
+    xcb_get_property_reply_t *reply;
+
+    if ( atom == XCB_ATOM_NONE ) {
+        return false;
+    }
+
+    cookie = xcb_get_property( ghost->conn,
+                               0, /* delete */
+                               ghost->winroot, /* the window */
+                               atom, /* the property */
+                               XCB_ATOM_WINDOW, /* the property type */
+                               0, /* data offset */
+                               UINT32_MAX /* the max length of the data */
+                             );
+    reply = xcb_get_property_reply( ghost->conn, cookie, NULL );
+
+    if ( !reply || reply->type != XCB_ATOM_WINDOW || reply->format != 32
+            || xcb_get_property_value_length( reply ) < 1 ) {
+        free( reply );
+        return false;
+    }
+
+    ght_win_array_push_all( clients,
+                            (xcb_window_t *) xcb_get_property_value( reply ),
+                            xcb_get_property_value_length( reply ) / sizeof( xcb_window_t ));
+
+    free( reply );
+
+    return true;
+}
+
+/*
+ * Checks the clients listed by the window manager in the root window's
+ * EWMH client list, which is read with a single request. The stacking
+ * ordered list is preferred so that the clients can be checked from the
+ * top down; the attributes of every client are then fetched in batches
+ * so that viewable clients are checked before hidden ones. Unmapped
+ * clients are skipped if ghost->scan_policy.skip_unmapped is set. Returns
+ * false if the root window has neither list.
+ */
+static bool
+load_client_list_windows( ghost_t *ghost )
+{
+    win_array_t clients = EMPTY_WIN_ARRAY;
+    win_array_t visible = EMPTY_WIN_ARRAY;
+    win_array_t hidden = EMPTY_WIN_ARRAY;
+    xcb_get_window_attributes_cookie_t *cookies;
+    uint8_t map_state;
+    xcb_window_t win;
+    int batch_size, start, count, i;
+
+    if ( !read_client_list( ghost, ghost->client_list_stacking_atom, &clients )
+            && !read_client_list( ghost, ghost->client_list_atom, &clients )) {
+        return false;
+    }
+
+    info( "[load_client_list_windows] Checking %d clients\n", clients.count );
+
+    /* one attributes request for each client */
+    batch_size = scan_batch_size( ghost, 1 );
+    cookies = checked_malloc( batch_size * sizeof( xcb_get_window_attributes_cookie_t ));
+
+    /* the lists are ordered bottom to top; go through them backwards */
+    for ( start=0; start<clients.count; start+=batch_size ) {
+        count = clients.count - start;
+        if ( count > batch_size ) {
+            count = batch_size;
+        }
+
+        for ( i=0; i<count; i++ ) {
+            win = clients.items[clients.count - 1 - start - i];
+            cookies[i] = xcb_get_window_attributes( ghost->conn, win );
+        }
+
+        for ( i=0; i<count; i++ ) {
+            win = clients.items[clients.count - 1 - start - i];
+            if ( is_skipped_window( ghost, win, cookies[i], &map_state )) {
+                continue;
+            }
+
+            if ( map_state == XCB_MAP_STATE_UNMAPPED && ghost->scan_policy.skip_unmapped ) {
+                debug( "[load_client_list_windows] Skipping unmapped client 0x%x\n", win );
+            } else {
+                ght_win_array_push( map_state == XCB_MAP_STATE_VIEWABLE ? &visible : &hidden,
+                                    win );
+            }
+        }
+    }
+
+    load_window_list( ghost, visible.items, NULL, visible.count, NULL );
+    load_window_list( ghost, hidden.items, NULL, hidden.count, NULL );
+
+    ght_win_array_free( &clients );
+    ght_win_array_free( &visible );
+    ght_win_array_free( &hidden );
+    free( cookies );
+
+    return true;
+}
+
+/*
+ * Removes the windows whose anchor is in the matched array from the
+ * given scan list.
+ */
+static void
+remove_children_of( scan_list_t *list, win_array_t *matched )
+{
+    map_t *matched_set;
+    int count = 0;
+    int i;
+
+    if ( matched->count < 1 ) {
+        return;
+    }
+
+    matched_set = ght_winmap_create( MAP_SIZE_MD );
+    for ( i=0; i<matched->count; i++ ) {
+        ght_map_put( matched_set, &(matched->items[i]), NULL );
+    }
+
+    for ( i=0; i<list->wins.count; i++ ) {
+        if ( ght_map_get_entry( matched_set, &(list->anchors.items[i]) ) == NULL ) {
+            list->wins.items[count] = list->wins.items[i];
+            list->anchors.items[count] = list->anchors.items[i];
+            list->tops.items[count] = list->tops.items[i];
+            count++;
+        }
+    }
+
+    list->wins.count = count;
+    list->anchors.count = count;
+    list->tops.count = count;
+
+    ght_map_free( matched_set );
+}
+
+/*
+ * Checks the hidden windows found by the tree scan one tree level at a
+ * time, where the levels begin at the given offsets into the list. If
+ * ghost->scan_policy.stop_at_match is set, windows below a hidden window
+ * that matched are not checked, however many levels down they are.
+ */
+static void
+load_hidden_windows( ghost_t *ghost, scan_list_t *hidden, int *level_starts, int level_count )
+{
+    map_t *excluded;
+    win_array_t found = EMPTY_WIN_ARRAY;
+    int start, end, count, l, i;
+
+    if ( !ghost->scan_policy.stop_at_match ) {
+        load_window_list( ghost, hidden->wins.items, hidden->tops.items, hidden->wins.count, NULL );
+        return;
+    }
+
+    /* the windows that matched and every window below them */
+    excluded = ght_winmap_create( MAP_SIZE_MD );
+
+    for ( l=0; l<level_count; l++ ) {
+        start = level_starts[l];
+        end = l + 1 < level_count ? level_starts[l + 1] : hidden->wins.count;
+
+        /* the anchors are on higher levels, so their results are known */
+        count = 0;
+        for ( i=start; i<end; i++ ) {
+            if ( ght_map_get_entry( excluded, &(hidden->anchors.items[i]) ) != NULL ) {
+                ght_map_put( excluded, &(hidden->wins.items[i]), NULL );
+            } else {
+                hidden->wins.items[start + count] = hidden->wins.items[i];
+                hidden->tops.items[start + count] = hidden->tops.items[i];
+                count++;
+            }
+        }
+
+        load_window_list( ghost, hidden->wins.items + start, hidden->tops.items + start,
+                          count, &found );
+
+        for ( i=0; i<found.count; i++ ) {
+            ght_map_put( excluded, &(found.items[i]), NULL );
+        }
+        ght_win_array_clear( &found );
+    }
+
+    ght_win_array_free( &found );
+    ght_map_free( excluded );
+}
+
+/*
+ * Checks the given window and its descendants, one tree level at a
+ * time, as allowed by ghost->scan_policy. The xcb_query_tree requests for
+ * a level are all sent before any of their replies are read (keeping
+ * up to ghost->scan_max_requests requests in flight) so that the scan
+ * costs about one round trip per tree level rather than one per window. The window
+ * attributes are requested along with the children so that windows that
+ * should not be matched, and unmapped subtrees if the policy says so, are
+ * skipped without fetching their properties. The scan is started from the
+ * root window, so the top-level window of every window it finds is known
+ * without resolving any parents.
+ *
+ * Each level is ordered from the top of the stack down, and only viewable
+ * windows are checked during the scan; the others are checked once every
+ * level has been scanned, so that the windows the user can see are the
+ * first to be matched.
+ */
+static void
+load_windows_breadth_first( ghost_t *ghost, xcb_window_t win )
+{
+    scan_list_t level = EMPTY_SCAN_LIST;
+    scan_list_t next = EMPTY_SCAN_LIST;
+    scan_list_t matchable = EMPTY_SCAN_LIST;
+    scan_list_t hidden = EMPTY_SCAN_LIST;
+    scan_list_t swap;
+    win_array_t found = EMPTY_WIN_ARRAY;
+    xcb_query_tree_cookie_t *cookies;
+    xcb_get_window_attributes_cookie_t *attr_cookies;
+    ght_scan_policy_t *policy = &(ghost->scan_policy);
+    xcb_window_t cur, anchor;
+    uint8_t map_state;
+    bool descend, skip;
+    int *hidden_levels = NULL;
+    int hidden_level_count = 0;
+    int depth = 0;
+    int batch_size, start, count, i, j;
+
+    /* a tree query and an attributes request for each window */
+    batch_size = scan_batch_size( ghost, 2 );
+    cookies = checked_malloc( batch_size * sizeof( xcb_query_tree_cookie_t ));
+    attr_cookies = checked_malloc( batch_size * sizeof( xcb_get_window_attributes_cookie_t ));
+
+    scan_list_push( &level, win, 0, 0 );
+
+    while ( level.wins.count > 0 ) {
+        debug( "[load_windows_breadth_first] Scanning %d windows at depth %d\n",
+               level.wins.count, depth );
+
+        /* the windows on the deepest allowed level have their children ignored */
+        descend = policy->max_depth < 0 || depth < policy->max_depth;
+
+        /* the hidden windows of this level, if any, start here */
+        hidden_levels = checked_realloc( hidden_levels, ( hidden_level_count + 1 ) * sizeof( int ));
+        hidden_levels[hidden_level_count] = hidden.wins.count;
+
+        /* query the children of every window on this level */
+        for ( start=0; start<level.wins.count; start+=batch_size ) {
+            count = level.wins.count - start;
+            if ( count > batch_size ) {
+                count = batch_size;
+            }
+
+            for ( i=0; i<count; i++ ) {
+                if ( descend ) {
+                    cookies[i] = xcb_query_tree( ghost->conn, level.wins.items[start + i] );
+                }
+                attr_cookies[i] = xcb_get_window_attributes( ghost->conn,
+                                                             level.wins.items[start + i] );
+            }
+
+            for ( i=0; i<count; i++ ) {
+                j = start + i;
+                cur = level.wins.items[j];
+                skip = is_skipped_window( ghost, cur, attr_cookies[i], &map_state );
+
+                if ( map_state == XCB_MAP_STATE_UNMAPPED && policy->skip_unmapped ) {
+                    /* ignore the whole subtree */
+                    if ( descend ) {
+                        xcb_discard_reply( ghost->conn, cookies[i].sequence );
+                    }
+                    continue;
+                }
+
+                /* skipped windows pass their own anchor on to their children */
+                anchor = level.anchors.items[j];
+                if ( !skip ) {
+                    scan_list_push( map_state == XCB_MAP_STATE_VIEWABLE || cur == win ? &matchable
+                                                                                      : &hidden,
+                                    cur, anchor, level.tops.items[j] );
+                    anchor = cur;
+                }
+
+                if ( descend ) {
+                    collect_children( ghost, cur, anchor, level.tops.items[j], cookies[i], &next );
+                }
+            }
+        }
+
+        if ( hidden.wins.count > hidden_levels[hidden_level_count] ) {
+            hidden_level_count++;
+        }
+
+        /* check the windows on this level */
+        load_window_list( ghost, matchable.wins.items, matchable.tops.items,
+                          matchable.wins.count, policy->stop_at_match ? &found : NULL );
+
+        if ( policy->stop_at_match ) {
+            remove_children_of( &next, &found );
+        }
+
+        /* move down to the next level */
+        scan_list_clear( &matchable );
+        ght_win_array_clear( &found );
+        scan_list_clear( &level );
+        swap = level;
+        level = next;
+        next = swap;
+        depth++;
+    }
+
+    /* now check the windows that cannot be seen */
+    load_hidden_windows( ghost, &hidden, hidden_levels, hidden_level_count );
+
+    scan_list_free( &level );
+    scan_list_free( &next );
+    scan_list_free( &matchable );
+    scan_list_free( &hidden );
+    ght_win_array_free( &found );
+    free( hidden_levels );
+    free( cookies );
+    free( attr_cookies );
+}
+
+/*
+ * Goes through the matchers on each rule in the list and looks up
+ * the corresponding xcb atom for the matcher name. This is stored
+ * on the matcher itself for use when compiling the rules.
+ *
+ * Each distinct name is interned once, and every intern request is sent
+ * before any reply is read, so this costs a single round trip however
+ * many rules there are. Atoms are created for names the server does not
+ * know yet, so that rules for a property first set by a client started
+ * later still match it. Matchers whose atom could not be interned get
+ * XCB_ATOM_NONE and never match.
+ */
+static void
+populate_rule_atoms( ghost_t *ghost, list_t *rules )
+{
+    map_t *names = ght_strmap_create( MAP_SIZE_MD );
+    xcb_intern_atom_cookie_t *cookies;
+    xcb_intern_atom_reply_t *reply;
+    xcb_atom_t *atoms;
+    map_entry_t *entry;
+    map_iter_t iter;
+    ght_rule_t *rule;
+    ght_matcher_t *matcher;
+    char *name;
+    int count = 0;
+    int i;
+
+    /* number the distinct names */
+    ght_list_for_each( rules, rule, ght_rule_t ) {
+        ght_list_for_each( &(rule->matchers), matcher, ght_matcher_t ) {
+            if ( ght_map_get_entry( names, matcher->name ) == NULL ) {
+                ght_map_put( names, matcher->name, (void *) (uintptr_t) count++ );
+            }
+        }
+    }
+
+    cookies = checked_malloc( count * sizeof( xcb_intern_atom_cookie_t ) + 1 );
+    atoms = checked_malloc( count * sizeof( xcb_atom_t ) + 1 );
+
+    ght_map_for_each_entry( names, &iter, entry ) {
+        name = entry->key;
+        cookies[(uintptr_t) entry->value] =
+            xcb_intern_atom( ghost->conn,
+                             0, /* only_if_exists; create atoms for unknown names */
+                             strlen( name ), /* data length */
+                             name /* the data */
+                           );
+    }
+
+    ght_map_for_each_entry( names, &iter, entry ) {
+        i = (uintptr_t) entry->value;
+        reply = xcb_intern_atom_reply( ghost->conn, cookies[i], NULL );
+
+        atoms[i] = reply ? reply->atom : XCB_ATOM_NONE;
+        if ( atoms[i] == XCB_ATOM_NONE ) {
+            warn( "Unable to intern property %s; rules using it will not match\n",
+                  (char *) entry->key );
+        }
+
+        free( reply );
+    }
+
+    debug( "[populate_rule_atoms] Interned %d distinct property names\n", count );
+
+    ght_list_for_each( rules, rule, ght_rule_t ) {
+        ght_list_for_each( &(rule->matchers), matcher, ght_matcher_t ) {
+            entry = ght_map_get_entry( names, matcher->name );
+            matcher->name_atom = atoms[(uintptr_t) entry->value];
+        }
+    }
+
+    ght_map_free( names );
+    free( cookies );
+    free( atoms );
+}
+
+/*
+ * Clears all entries in the given map. If free_values is true, the
+ * value memory will also be freed.
+ */
+static void
+clear_dynamic_map( map_t *map, bool free_values)
+{
+    map_entry_t *entry;
+    map_iter_t iter;
+    ght_map_for_each_entry( map, &iter, entry ) {
+        if ( free_values ) {
+            free( entry->value );
+        }
+        ght_map_remove_entry( map, entry );
+    }
+}
+
+/*
+ * Clears and frees all memory associated with a list of matchers.
+ */
+static void
+clear_matcher_list( list_t *matcher_list)
+{
+    list_iter_t iter;
+    ght_matcher_t *matcher;
+    ght_list_mod_for_each( matcher_list, &iter, matcher, ght_matcher_t ) {
+        ght_list_remove( matcher_list, matcher );
+        free( matcher );
+    }
+}
+
+/*
+ * Clears and frees all memory associated with a list of rules.
+ */
+static void
+clear_rule_list( list_t *rule_list )
+{
+    list_iter_t iter;
+    ght_rule_t *rule;
+    ght_list_mod_for_each( rule_list, &iter, rule, ght_rule_t ) {
+        clear_matcher_list( &(rule->matchers) );
+        ght_list_remove( rule_list, rule );
+        free( rule );
+    }
+}
+
+/*
+ * Compiles the parsed rule list into the ghost's rule set, replacing
+ * any previous rule set, and frees the rule list. Returns the number of
+ * rules in the list.
+ */
+static int
+compile_rules( ghost_t *ghost, list_t *rules, int count )
+{
+    ght_ruleset_free( ghost->ruleset );
+    ghost->ruleset = NULL;
+
+    if ( count > 0 ) {
+        populate_rule_atoms( ghost, rules );
+        ghost->ruleset = ght_ruleset_create( rules );
+    }
+
+    /* the rule set holds its own copy of everything it needs */
+    clear_rule_list( rules );
+
+    prune_prop_caches( ghost );
+
+    /* windows that matched no rule must be matched against the new rules */
+    ghost->rule_generation++;
+
+    return count;
+}
+
+/* ##################### Ghost functions ################## */
+
+/*
+ * Convenience object for initializing empty lists.
+ */
+static const list_t EMPTY_LIST = { NULL };
+
+ghost_t *
+ght_create( const char *displayname, int *screenp )
+{
+    ghost_t *ghost = checked_malloc( sizeof( ghost_t ));
+
+    /* initialize members */
+    ghost->win_map = ght_winmap_create( MAP_SIZE_LG );
+    ghost->target_win_map = ght_winmap_create( MAP_SIZE_LG );
+    ghost->applied_opacity_map = ght_winmap_create( MAP_SIZE_LG );
+    ghost->event_mask_map = ght_winmap_create( MAP_SIZE_LG );
+    ghost->prop_cache = ght_winmap_create( MAP_SIZE_LG );
+    ghost->pending_map = ght_winmap_create( MAP_SIZE_SM );
+    ghost->negative_cache = ght_winmap_create( MAP_SIZE_LG );
+    ghost->parent_map = ght_winmap_create( MAP_SIZE_LG );
+    ghost->eval_map = ght_winmap_create( MAP_SIZE_MD );
+    ghost->eval_max_in_flight = DEFAULT_EVAL_MAX_IN_FLIGHT;
+    ghost->scan_max_requests = DEFAULT_SCAN_MAX_REQUESTS;
+    ghost->scan_policy.max_depth = -1;
+
+    /* connect to the x server */
+    ghost->conn = xcb_connect( displayname, screenp );
+
+    /* get the root window */
+    const xcb_setup_t *setup = xcb_get_setup( ghost->conn );
+    ghost->winroot = xcb_setup_roots_iterator( setup ).data->root;
+
+    /* get the opacity atom */
+    ghost->opacity_atom = atom_for_name( ghost, OPACITY, false );
+
+    /* get the window manager atoms if a window manager has created them */
+    ghost->client_list_atom = atom_for_name( ghost, CLIENT_LIST, true );
+    ghost->client_list_stacking_atom = atom_for_name( ghost, CLIENT_LIST_STACKING, true );
+    ghost->active_window_atom = atom_for_name( ghost, ACTIVE_WINDOW, true );
+
+    return ghost;
+}
+
+void
+ght_destroy( ghost_t *ghost )
+{
+    map_entry_t *entry;
+    map_iter_t iter;
+
+    /* log the errors of any requests that have not been answered yet */
+    if ( !xcb_connection_has_error( ghost->conn )) {
+        collect_request_errors( ghost, true );
+    }
+    free( ghost->checked_requests );
+
+    /* disconnect from the x server */
+    xcb_disconnect( ghost->conn );
+
+    debug( "[ght_destroy] disconnected\n" );
+
+    info( "[ght_destroy] Skipped %lu redundant opacity writes\n",
+          ghost->opacity_writes_saved );
+
+    /* clear the rules */
+    if ( ghost->ruleset != NULL ) {
+        debug( "[ght_destroy] match memo: %lu hits, %lu misses\n",
+               ghost->ruleset->memo_hits, ghost->ruleset->memo_misses );
+    }
+    ght_ruleset_free( ghost->ruleset );
+
+    debug( "[ght_destroy] rules cleared\n" );
+
+    /*
+     * Clear the target window lookup map.
+     * Dont' free the values here since they'll
+     * be freed through the win_map.
+     */
+    clear_dynamic_map( ghost->target_win_map,  false );
+    ght_map_free( ghost->target_win_map );
+
+    debug( "[ght_destroy] target win map cleared\n" );
+
+    /* the values are stored in the maps themselves */
+    ght_map_free( ghost->applied_opacity_map );
+    ght_map_free( ghost->event_mask_map );
+
+    /* clear and release the window map */
+    clear_dynamic_map( ghost->win_map, true );
+    ght_map_free( ghost->win_map );
+
+    debug( "[ght_destroy] win map cleared\n" );
+
+    /* clear and release the property cache */
+    clear_prop_caches( ghost );
+    ght_map_free( ghost->prop_cache );
+
+    debug( "[ght_destroy] property cache cleared\n" );
+
+    /* clear and release the deferred matches */
+    clear_dynamic_map( ghost->pending_map, true );
+    ght_map_free( ghost->pending_map );
+
+    /* clear and release the negative match cache */
+    clear_dynamic_map( ghost->negative_cache, true );
+    ght_map_free( ghost->negative_cache );
+
+    /* release the window evaluations; their replies went with the connection */
+    ght_map_for_each_entry( ghost->eval_map, &iter, entry ) {
+        free_evaluation( ght_map_remove_entry( ghost->eval_map, entry ));
+    }
+    ght_map_free( ghost->eval_map );
+    ght_win_array_free( &(ghost->eval_queue) );
+    ght_win_array_free( &(ghost->focus_changes) );
+
+    /* clear and release the parent map; its values are not pointers */
+    clear_dynamic_map( ghost->parent_map, false );
+    ght_map_free( ghost->parent_map );
+
+    /* free the ghost itself */
+    free( ghost );
+
+    info( "[ght_destroy] ghost destroyed\n" );
+}
+
+int
+ght_load_rule_file( ghost_t *ghost, char *rulefile )
+{
+    list_t rules = EMPTY_LIST;
+
+    /* load the new rules */
+    int count = ght_parse_rules_from_file( rulefile, &rules );
+
+    return compile_rules( ghost, &rules, count );
+}
+
+int
+ght_load_rule_str( ghost_t *ghost, char *rulestr )
+{
+    list_t rules = EMPTY_LIST;
+
+    /* load the new rules */
+    int count = ght_parse_rules_from_string( rulestr, &rules );
+
+    return compile_rules( ghost, &rules, count );
+}
+
+void
+ght_load_windows( ghost_t *ghost )
+{
+    /* clear the current maps */
+    clear_dynamic_map( ghost->target_win_map, 0 );
+    clear_dynamic_map( ghost->applied_opacity_map, 0 );
+    clear_dynamic_map( ghost->win_map, 1 );
+
+    /*
+     * Cached properties are only invalidated while monitoring, so
+     * they cannot be trusted otherwise.
+     */
+    if ( !ghost->monitoring ) {
+        clear_prop_caches( ghost );
+        clear_dynamic_map( ghost->negative_cache, true );
+    }
+
+    /* windows are given their focus opacity as they are found */
+    if ( ghost->apply_on_load ) {
+        ghost->focused_win = get_focused_window( ghost );
+    }
+
+    /*
+     * Use the window manager's client list if we can and fall back to
+     * scanning the whole window tree.
+     */
+    if ( !ghost->scan_tree && load_client_list_windows( ghost )) {
+        debug( "[ght_load_windows] Loaded windows from the client list\n" );
+    } else {
+        load_windows_breadth_first( ghost, ghost->winroot );
+    }
+
+    /* keep only the parent links that may be needed later */
+    prune_parent_map( ghost );
+
+    /* the opacity settings applied while loading have not been sent yet */
+    if ( ghost->streaming || ghost->apply_on_load ) {
+        xcb_flush( ghost->conn );
+    }
+}
+
+/*
+ * Returns the current time of a monotonic clock in milliseconds.
+ */
+static uint64_t
+current_time_ms( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Defers matching of a newly created window. Its properties are usually
+ * set after it is created, so matching right away would waste the round
+ * trips. The window is watched so that its map and property events
+ * arrive, and a match is scheduled in case neither does.
+ */
+static void
+defer_window( ghost_t *ghost, xcb_window_t win )
+{
+    pending_match_t *pending = checked_malloc( sizeof( pending_match_t ));
+    pending->deadline = current_time_ms() + MATCH_DELAY;
+
+    free( ght_map_put( ghost->pending_map, &win, pending ));
+
+    if ( ghost->pending_deadline == 0 || pending->deadline < ghost->pending_deadline ) {
+        ghost->pending_deadline = pending->deadline;
+    }
+
+    watch_window( ghost, win );
+}
+
+/*
+ * Stops any deferred matching of the given window. Returns true if the
+ * window was pending. The earliest deadline is left alone; if it was this
+ * window's, the monitor loop wakes up once for nothing and moves it on.
+ */
+static bool
+stop_pending( ghost_t *ghost, xcb_window_t win )
+{
+    pending_match_t *pending = ght_map_remove( ghost->pending_map, &win );
+    free( pending );
+    return pending != NULL;
+}
+
+/*
+ * Returns the number of milliseconds until the next deferred match is
+ * due, or -1 if no windows are pending.
+ */
+static int
+next_deferred_timeout( ghost_t *ghost )
+{
+    uint64_t now;
+
+    if ( ghost->pending_deadline == 0 ) {
+        return -1;
+    }
+
+    now = current_time_ms();
+    if ( ghost->pending_deadline <= now ) {
+        return 0;
+    }
+
+    return ghost->pending_deadline - now;
+}
+
+/*
+ * Moves the tracked window to the given top-level window, along with its
+ * focus events, and applies its normal opacity there.
+ */
+static void
+retarget_window( ghost_t *ghost, ght_window_t *ght_win, xcb_window_t target )
+{
+    xcb_window_t old_target = ght_win->target_win;
+
+    reparent_window( ghost, ght_win, target );
+
+    /* move the focus events to the new target */
+    register_window_events( ghost, ght_win );
+    update_window_events( ghost, old_target );
+
+    /* apply the initial normal opacity */
+    apply_opacity( ghost, ght_win, ght_win->normal_opacity );
+}
+
+/*
+ * Applies the result of matching the given watched window against the
+ * rules, where idx is the index of the matching rule and target is the
+ * top-level window if it was looked up, or 0: untracked windows that
+ * match start being tracked, tracked windows that no longer match have
+ * their opacity property removed, tracked windows whose top-level window
+ * changed are moved to it and tracked windows that match a rule with
+ * different settings are updated. Windows that end up tracked are no
+ * longer pending.
+ */
+static void
+apply_match( ghost_t *ghost, xcb_window_t win, xcb_window_t target, int idx )
+{
+    ght_window_t *ght_win = find_window( ghost, win );
+    xcb_window_t old_target;
+
+    if ( ght_win == NULL ) {
+        if ( idx != GHT_NO_RULE ) {
+            /* the window matches now; start tracking it */
+            ght_win = create_window( ghost, win, target, idx );
+            track_window( ghost, ght_win );
+            register_window_events( ghost, ght_win );
+            apply_opacity( ghost, ght_win, ght_win->normal_opacity );
+        }
+    } else if ( idx == GHT_NO_RULE ) {
+        /* the window no longer matches; leave it opaque */
+        info( "[apply_match] Window 0x%x no longer matches any rule\n", win );
+        old_target = ght_win->target_win;
+        remove_opacity( ghost, old_target );
+        untrack_window( ghost, ght_win );
+
+        /* drop the focus events of the target it no longer has */
+        update_window_events( ghost, old_target );
+    } else {
+        if ( target != 0 && target != ght_win->target_win ) {
+            /* the window was reparented under another top-level window */
+            retarget_window( ghost, ght_win, target );
+        }
+
+        if ( ght_win->focus_opacity != ghost->ruleset->focus_opacity[idx]
+                || ght_win->normal_opacity != ghost->ruleset->normal_opacity[idx] ) {
+            /* the window matches a rule with different settings */
+            ght_win->focus_opacity = ghost->ruleset->focus_opacity[idx];
+            ght_win->normal_opacity = ghost->ruleset->normal_opacity[idx];
+
+            apply_opacity( ghost, ght_win,
+                           is_focused( ghost, ght_win ) ? ght_win->focus_opacity
+                                                        : ght_win->normal_opacity );
+        }
     }
 
-    child_count = xcb_query_tree_children_length( reply );
+    if ( find_window( ghost, win ) != NULL ) {
+        stop_pending( ghost, win );
+    }
+}
 
-    child = xcb_query_tree_children( reply );
+/*
+ * Discards the replies to any requests the evaluation has in flight
+ * and puts it back in the queued state.
+ */
+static void
+reset_evaluation( ghost_t *ghost, eval_ctx_t *ctx )
+{
     int i;
-    for ( i=0; i<child_count; i++ ) {
-        load_windows_recursive( ghost, child[i] );
+
+    if ( ctx->state == EVAL_PROPERTIES ) {
+        for ( i=0; i<ctx->atom_count; i++ ) {
+            if ( ctx->waiting[i] ) {
+                xcb_discard_reply( ghost->conn, ctx->cookies[i].sequence );
+                ctx->waiting[i] = false;
+            }
+        }
+    } else if ( ctx->state == EVAL_PARENT ) {
+        xcb_discard_reply( ghost->conn, ctx->tree_cookie.sequence );
     }
 
-    free( reply );
+    if ( ctx->state != EVAL_QUEUED ) {
+        ghost->eval_in_flight--;
+    }
+
+    ctx->outstanding = 0;
+    ctx->state = EVAL_QUEUED;
 }
 
 /*
- * Goes through the matchers on each configured rule and looks up
- * the corresponding xcb atom for the matcher name. This is stored
- * on the matcher itself to speed up window matching.
+ * Queues the given window to be matched against the rules again. The
+ * result is applied with apply_match() once the evaluation completes. An
+ * evaluation already in flight for the window is started over since its
+ * replies may be out of date.
  */
 static void
-populate_rule_atoms( ghost_t *ghost )
+queue_evaluation( ghost_t *ghost, xcb_window_t win )
 {
-    ght_rule_t *rule;
-    ght_matcher_t *matcher;
+    eval_ctx_t *ctx = ght_map_get( ghost->eval_map, &win );
+
+    if ( ctx == NULL ) {
+        ctx = checked_malloc( sizeof( eval_ctx_t ));
+        ctx->win = win;
+        ctx->state = EVAL_QUEUED;
+        ght_map_put( ghost->eval_map, &win, ctx );
+    } else if ( ctx->state != EVAL_QUEUED ) {
+        reset_evaluation( ghost, ctx );
+    } else {
+        /* already waiting for a slot */
+        return;
+    }
+
+    ght_win_array_push( &(ghost->eval_queue), win );
+}
+
+/*
+ * Queues an evaluation of the given tracked window that also walks its
+ * parent chain, for when its top-level window is not known after it was
+ * reparented. Nothing waits for the parent queries.
+ */
+static void
+queue_retarget( ghost_t *ghost, xcb_window_t win )
+{
+    eval_ctx_t *ctx;
+
+    queue_evaluation( ghost, win );
+
+    ctx = ght_map_get( ghost->eval_map, &win );
+    ctx->retarget = true;
+}
+
+/*
+ * Drops the evaluation of the given window, if any.
+ */
+static void
+cancel_evaluation( ghost_t *ghost, xcb_window_t win )
+{
+    eval_ctx_t *ctx = ght_map_remove( ghost->eval_map, &win );
+
+    if ( ctx != NULL ) {
+        reset_evaluation( ghost, ctx );
+        free_evaluation( ctx );
+    }
+}
+
+/*
+ * Starts the given queued evaluation by sending the requests for the
+ * match properties of the window that are not cached.
+ */
+static void
+begin_evaluation( ghost_t *ghost, eval_ctx_t *ctx )
+{
+    int atom_count = 0;
+
+    if ( ghost->ruleset != NULL && !is_known_nonmatching( ghost, ctx->win )) {
+        atom_count = ghost->ruleset->atom_count;
+    }
+
+    if ( ctx->cookies == NULL || ctx->atom_count != atom_count ) {
+        free( ctx->cookies );
+        free( ctx->waiting );
+        ctx->cookies = checked_malloc( atom_count * sizeof( xcb_get_property_cookie_t ) + 1 );
+        ctx->waiting = checked_malloc( atom_count * sizeof( bool ) + 1 );
+        ctx->atom_count = atom_count;
+    }
+
+    ctx->outstanding = 0;
+    if ( atom_count > 0 ) {
+        ctx->outstanding = request_match_properties( ghost, ctx->win,
+                                                     ensure_prop_cache( ghost, ctx->win ),
+                                                     ctx->cookies, ctx->waiting );
+    }
+
+    ctx->state = EVAL_PROPERTIES;
+    ghost->eval_in_flight++;
+}
+
+/*
+ * Follows the parent chain from ctx->walk_from through the links that can
+ * be trusted and moves the evaluation to the step of querying the parent
+ * of the first window whose parent is unknown or unconfirmed. Returns
+ * false if the chain reaches the root window, in which case ctx->target
+ * is set to the top-level window.
+ */
+static bool
+query_next_parent( ghost_t *ghost, eval_ctx_t *ctx )
+{
+    xcb_window_t cur = ctx->walk_from;
+    xcb_window_t parent;
+
+    while (( parent = known_parent( ghost, cur )) && parent != ghost->winroot ) {
+        cur = parent;
+    }
+
+    if ( parent == ghost->winroot ) {
+        ctx->target = cur;
+        return false;
+    }
+
+    ctx->querying = cur;
+    ctx->tree_cookie = xcb_query_tree( ghost->conn, cur );
+    ctx->state = EVAL_PARENT;
+
+    return true;
+}
+
+/*
+ * Stores every property reply of the evaluation that has arrived in the
+ * property cache of the window. Sets *progress if any reply was read.
+ */
+static void
+poll_properties( ghost_t *ghost, eval_ctx_t *ctx, bool *progress )
+{
+    xcb_get_property_reply_t *reply;
+    xcb_generic_error_t *err;
+    cached_prop_t *prop;
+    int i;
+
+    for ( i=0; i<ctx->atom_count && ctx->outstanding > 0; i++ ) {
+        reply = NULL;
+        err = NULL;
+        if ( !ctx->waiting[i]
+                || !xcb_poll_for_reply( ghost->conn, ctx->cookies[i].sequence,
+                                        (void **) &reply, &err )) {
+            continue;
+        }
+
+        free( err );
+        ctx->waiting[i] = false;
+        ctx->outstanding--;
+        *progress = true;
+
+        prop = add_cached_prop( ensure_prop_cache( ghost, ctx->win ), ghost->ruleset->atoms[i] );
+        prop->reply = take_string_value( reply, &(prop->value) );
+    }
+}
+
+/*
+ * Advances the evaluation as far as the replies that have arrived allow
+ * without waiting for any others. Sets *progress if any reply was read.
+ * Returns true once the evaluation is complete and its result applied.
+ */
+static bool
+advance_evaluation( ghost_t *ghost, eval_ctx_t *ctx, bool *progress )
+{
+    xcb_query_tree_reply_t *reply;
+    xcb_generic_error_t *err;
+
+    if ( ctx->state == EVAL_PROPERTIES ) {
+        poll_properties( ghost, ctx, progress );
+        if ( ctx->outstanding > 0 ) {
+            return false;
+        }
+
+        /* every property is cached now so this costs no round trips */
+        ctx->idx = match_window( ghost, ctx->win, true );
+
+        /* only windows that start being tracked or were reparented need
+         * their top-level window */
+        ctx->walk_from = ctx->win;
+        ctx->target = 0;
+        if ( ctx->idx != GHT_NO_RULE
+                && ( find_window( ghost, ctx->win ) == NULL || ctx->retarget )
+                && query_next_parent( ghost, ctx )) {
+            return false;
+        }
+    } else if ( ctx->state == EVAL_PARENT ) {
+        reply = NULL;
+        err = NULL;
+        if ( !xcb_poll_for_reply( ghost->conn, ctx->tree_cookie.sequence,
+                                  (void **) &reply, &err )) {
+            return false;
+        }
+
+        free( err );
+        *progress = true;
+
+        if ( !reply || !reply->parent ) {
+            /* the window is gone; its destruction is handled as an event */
+            debug( "[advance_evaluation] Window 0x%x has no parent\n", ctx->querying );
+            free( reply );
+            return true;
+        }
+
+        /* the reply confirms the link, so carry on from the parent */
+        set_parent( ghost, ctx->querying, reply->parent );
+        if ( reply->parent == ghost->winroot ) {
+            ctx->target = ctx->querying;
+        } else {
+            ctx->walk_from = reply->parent;
+        }
+        free( reply );
+
+        if ( ctx->target == 0 && query_next_parent( ghost, ctx )) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    apply_match( ghost, ctx->win, ctx->target, ctx->idx );
+    return true;
+}
+
+/*
+ * Advances every evaluation in flight as far as the replies that have
+ * arrived allow, and begins queued evaluations while fewer than
+ * ghost->eval_max_in_flight are in flight. Nothing here waits for a
+ * reply, so a slow window never holds up the others or the event loop.
+ * Returns true if any evaluation moved on.
+ */
+static bool
+run_evaluations( ghost_t *ghost )
+{
+    win_array_t *queue = &(ghost->eval_queue);
+    eval_ctx_t *ctx;
+    map_entry_t *entry;
+    map_iter_t iter;
+    bool progress = true;
+    bool any = false;
+    int started;
+
+    while ( progress ) {
+        progress = false;
+
+        ght_map_for_each_entry( ghost->eval_map, &iter, entry ) {
+            ctx = entry->value;
+            if ( ctx->state != EVAL_QUEUED && advance_evaluation( ghost, ctx, &progress )) {
+                ghost->eval_in_flight--;
+                ght_map_remove_entry( ghost->eval_map, entry );
+                free_evaluation( ctx );
+                progress = true;
+            }
+        }
+
+        /* fill the free slots in queue order */
+        for ( started=0; started<queue->count
+                && ghost->eval_in_flight < ghost->eval_max_in_flight; started++ ) {
+            ctx = ght_map_get( ghost->eval_map, &(queue->items[started]) );
+            if ( ctx != NULL && ctx->state == EVAL_QUEUED ) {
+                begin_evaluation( ghost, ctx );
+                progress = true;
+            }
+        }
+
+        if ( started > 0 ) {
+            memmove( queue->items, queue->items + started,
+                     ( queue->count - started ) * sizeof( xcb_window_t ));
+            queue->count -= started;
+        }
+
+        any |= progress;
+    }
+
+    return any;
+}
+
+/*
+ * Returns the number of milliseconds the monitor loop may wait for the
+ * connection before it has other work to do, or -1 for no limit.
+ */
+static int
+next_wakeup_timeout( ghost_t *ghost )
+{
+    int timeout = next_deferred_timeout( ghost );
+    uint64_t now;
+
+    if ( ghost->eval_queue.count > 0 && ghost->eval_in_flight < ghost->eval_max_in_flight ) {
+        return 0;
+    }
 
-    ght_list_for_each( &(ghost->rules), rule, ght_rule_t ) {
-        ght_list_for_each( &(rule->matchers), matcher, ght_matcher_t ) {
-            matcher->name_atom = atom_for_name( ghost, matcher->name );
+    /* wake up in time to apply the settled focus */
+    if ( ghost->focus_changes.count > 0 ) {
+        now = current_time_ms();
+        if ( ghost->focus_deadline <= now ) {
+            return 0;
+        }
+        if ( timeout < 0 || ghost->focus_deadline - now < (uint64_t) timeout ) {
+            timeout = ghost->focus_deadline - now;
         }
     }
+
+    return timeout;
 }
 
 /*
- * Clears all entries in the given map. If free_values is true, the
- * value memory will also be freed.
+ * Queues a match for every pending window whose deadline has passed and
+ * stops it being pending, once the earliest deadline has passed, and
+ * moves that deadline on to the windows left. Each window is matched
+ * once, fetching its properties at most once: the window was watched
+ * before anything was fetched, so a cache filled by an earlier evaluation
+ * is valid, and from here on PropertyNotify keeps the cache valid and
+ * queues a new match whenever a rule property changes. Returns true if
+ * any match was queued.
  */
-static void
-clear_dynamic_map( map_t *map, bool free_values)
+static bool
+run_deferred_matches( ghost_t *ghost )
 {
+    pending_match_t *pending;
     map_entry_t *entry;
     map_iter_t iter;
-    ght_map_for_each_entry( map, &iter, entry ) {
-        if ( free_values ) {
-            free( entry->value );
+    xcb_window_t win;
+    uint64_t now;
+    bool any = false;
+
+    if ( ghost->pending_deadline == 0 ) {
+        return false;
+    }
+
+    now = current_time_ms();
+    if ( now < ghost->pending_deadline ) {
+        return false;
+    }
+
+    ghost->pending_deadline = 0;
+    ght_map_for_each_entry( ghost->pending_map, &iter, entry ) {
+        pending = entry->value;
+        if ( pending->deadline > now ) {
+            if ( ghost->pending_deadline == 0 || pending->deadline < ghost->pending_deadline ) {
+                ghost->pending_deadline = pending->deadline;
+            }
+            continue;
         }
-        ght_map_remove_entry( map, entry );
+
+        win = *((xcb_window_t *) entry->key);
+
+        debug( "[run_deferred_matches] Deferred match for window 0x%x\n", win );
+
+        queue_evaluation( ghost, win );
+
+        free( pending );
+        ght_map_remove_entry( ghost->pending_map, entry );
+        any = true;
     }
+
+    return any;
 }
 
 /*
- * Clears and frees all memory associated with a list of matchers.
+ * Logs the number of opacity writes skipped so far if it changed since
+ * the last report, made at *report_time, and the report interval has
+ * passed. This is only checked when the monitor loop is awake anyway, so
+ * it never causes a wakeup of its own.
  */
 static void
-clear_matcher_list( list_t *matcher_list)
+report_saved_writes( ghost_t *ghost, unsigned long *reported, uint64_t *report_time )
 {
-    list_iter_t iter;
-    ght_matcher_t *matcher;
-    ght_list_mod_for_each( matcher_list, &iter, matcher, ght_matcher_t ) {
-        ght_list_remove( matcher_list, matcher );
-        free( matcher );
+    uint64_t now;
+
+    if ( ghost->opacity_writes_saved == *reported ) {
+        return;
+    }
+
+    now = current_time_ms();
+    if ( now - *report_time < SAVED_WRITES_REPORT_INTERVAL ) {
+        return;
     }
+
+    info( "[report_saved_writes] Skipped %lu redundant opacity writes\n",
+          ghost->opacity_writes_saved );
+
+    *reported = ghost->opacity_writes_saved;
+    *report_time = now;
 }
 
 /*
- * Clears and frees all memory associated with a list of rules.
+ * Waits until the X connection has data to read or the timeout (in
+ * milliseconds, -1 for none) expires. Everything must have been flushed,
+ * and everything the flush read handled, beforehand: the poll does not
+ * see data that is already queued.
  */
 static void
-clear_rule_list( list_t *rule_list )
+wait_for_events( ghost_t *ghost, int timeout )
 {
-    list_iter_t iter;
-    ght_rule_t *rule;
-    ght_list_mod_for_each( rule_list, &iter, rule, ght_rule_t ) {
-        clear_matcher_list( &(rule->matchers) );
-        ght_list_remove( rule_list, rule );
-        free( rule );
-    }
-}
+    struct pollfd fds[1];
 
-/* ##################### Ghost functions ################## */
+    fds[0].fd = xcb_get_file_descriptor( ghost->conn );
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+
+    poll( fds, 1, timeout );
+}
 
 /*
- * Convenience object for initializing empty lists.
+ * Records that the focus state of the given window changed. The opacity
+ * is applied by apply_focus_changes() once the focus has settled, so that
+ * only the final state of each window is written. The focus is considered
+ * settled ghost->focus_debounce milliseconds after the first unapplied
+ * change; later changes do not push that deadline back.
  */
-static const list_t EMPTY_LIST = { NULL };
-
-ghost_t *
-ght_create( const char *displayname, int *screenp )
+static void
+note_focus_change( ghost_t *ghost, xcb_window_t win )
 {
-    ghost_t *ghost = checked_malloc( sizeof( ghost_t ));
-
-    /* initialize members */
-    ghost->rules = EMPTY_LIST;
-    ghost->win_map = ght_winmap_create( MAP_SIZE_LG );
-    ghost->target_win_map = ght_winmap_create( MAP_SIZE_LG );
-
-    /* connect to the x server */
-    ghost->conn = xcb_connect( displayname, screenp );
+    int i;
 
-    /* get the root window */
-    const xcb_setup_t *setup = xcb_get_setup( ghost->conn );
-    ghost->winroot = xcb_setup_roots_iterator( setup ).data->root;
+    if ( ghost->focus_changes.count == 0 ) {
+        ghost->focus_deadline = current_time_ms() + ghost->focus_debounce;
+    }
 
-    /* get the opacity atom */
-    ghost->opacity_atom = atom_for_name( ghost, OPACITY );
+    for ( i=0; i<ghost->focus_changes.count; i++ ) {
+        if ( ghost->focus_changes.items[i] == win ) {
+            return;
+        }
+    }
 
-    return ghost;
+    ght_win_array_push( &(ghost->focus_changes), win );
 }
 
-void
-ght_destroy( ghost_t *ghost )
+/*
+ * Applies the focus or normal opacity, according to the final focus
+ * state, to every tracked window whose focus changed, once the focus
+ * change deadline has passed. Returns true if the changes were applied.
+ */
+static bool
+apply_focus_changes( ghost_t *ghost )
 {
-    /* disconnect from the x server */
-    xcb_disconnect( ghost->conn );
-
-    debug( "[ght_destroy] disconnected\n" );
-
-    /* clear the rules list */
-    clear_rule_list( &(ghost->rules) );
-
-    debug( "[ght_destroy] rules cleared\n" );
-
-    /*
-     * Clear the target window lookup map.
-     * Dont' free the values here since they'll
-     * be freed through the win_map.
-     */
-    clear_dynamic_map( ghost->target_win_map,  false );
-    ght_map_free( ghost->target_win_map );
-
-    debug( "[ght_destroy] target win map cleared\n" );
-
-    /* clear and release the window map */
-    clear_dynamic_map( ghost->win_map, true );
-    ght_map_free( ghost->win_map );
+    ght_window_t *ght_win;
+    int i;
 
-    debug( "[ght_destroy] win map cleared\n" );
+    if ( ghost->focus_changes.count == 0 || current_time_ms() < ghost->focus_deadline ) {
+        return false;
+    }
 
-    /* free the ghost itself */
-    free( ghost );
+    for ( i=0; i<ghost->focus_changes.count; i++ ) {
+        /* focus events report targets; the active window is a client */
+        ght_win = find_window_by_target( ghost, ghost->focus_changes.items[i] );
+        if ( ght_win == NULL ) {
+            ght_win = find_window( ghost, ghost->focus_changes.items[i] );
+        }
+        if ( ght_win != NULL ) {
+            apply_opacity( ghost, ght_win,
+                           is_focused( ghost, ght_win ) ? ght_win->focus_opacity
+                                                        : ght_win->normal_opacity );
+        }
+    }
 
-    info( "[ght_destroy] ghost destroyed\n" );
+    ght_win_array_clear( &(ghost->focus_changes) );
+    return true;
 }
 
-int
-ght_load_rule_file( ghost_t *ghost, char *rulefile )
+/*
+ * Returns the window in the given _NET_ACTIVE_WINDOW reply, or 0 if there
+ * is none. The reply is freed.
+ */
+static xcb_window_t
+active_window_from_reply( xcb_get_property_reply_t *reply )
 {
-    /* clear the rules list */
-    clear_rule_list( &(ghost->rules) );
+    xcb_window_t active = 0;
 
-    /* load the new rules */
-    int count = ght_parse_rules_from_file( rulefile, &(ghost->rules ));
-    if ( count > 0 ) {
-        populate_rule_atoms( ghost );
+    if ( reply && reply->type == XCB_ATOM_WINDOW && reply->format == 32
+            && xcb_get_property_value_length( reply ) >= (int) sizeof( xcb_window_t )) {
+        active = *((xcb_window_t *) xcb_get_property_value( reply ));
     }
 
-    return count;
+    free( reply );
+
+    return active;
 }
 
-int
-ght_load_rule_str( ghost_t *ghost, char *rulestr )
+/*
+ * Sends a request for the root window's _NET_ACTIVE_WINDOW property.
+ */
+static xcb_get_property_cookie_t
+request_active_window( ghost_t *ghost )
 {
-    /* clear the rules list */
-    clear_rule_list( &(ghost->rules) );
-
-    /* load the new rules */
-    int count = ght_parse_rules_from_string( rulestr, &(ghost->rules ));
-    if ( count > 0 ) {
-        populate_rule_atoms( ghost );
-    }
-
-    return count;
+    return xcb_get_property( ghost->conn,
+                             0, /* delete */
+                             ghost->winroot, /* the window */
+                             ghost->active_window_atom, /* the property */
+                             XCB_ATOM_WINDOW, /* the property type */
+                             0, /* data offset */
+                             1 /* the max length of the data */
+                           );
 }
 
-void
-ght_load_windows( ghost_t *ghost )
+/*
+ * Asks for the new active window after the root window reported a change
+ * of _NET_ACTIVE_WINDOW. The reply is picked up by poll_active_window();
+ * a request still in flight is superseded.
+ */
+static void
+refresh_active_window( ghost_t *ghost )
 {
-    /* clear the current maps */
-    clear_dynamic_map( ghost->target_win_map, 0 );
-    clear_dynamic_map( ghost->win_map, 1 );
+    if ( ghost->active_window_pending ) {
+        xcb_discard_reply( ghost->conn, ghost->active_window_cookie.sequence );
+    }
 
-    /* scan the whole window tree */
-    load_windows_recursive( ghost, ghost->winroot );
+    ghost->active_window_cookie = request_active_window( ghost );
+    ghost->active_window_pending = true;
 }
 
-void
-ght_apply_opacity_settings( ghost_t *ghost, bool consider_focused_states )
+/*
+ * Takes the reply to the last refresh_active_window() request if it has
+ * arrived, without waiting for it. When the active window changed, the
+ * focus changes of the old and the new active windows are noted. Returns
+ * true if the reply was taken.
+ */
+static bool
+poll_active_window( ghost_t *ghost )
 {
-    xcb_window_t focus = 0;
-    float opacity;
-    map_iter_t iter;
-    ght_window_t *ght_win;
+    xcb_get_property_reply_t *reply = NULL;
+    xcb_generic_error_t *err = NULL;
+    xcb_window_t active;
+
+    if ( !ghost->active_window_pending
+            || !xcb_poll_for_reply( ghost->conn, ghost->active_window_cookie.sequence,
+                                    (void **) &reply, &err )) {
+        return false;
+    }
+
+    free( err );
+    ghost->active_window_pending = false;
 
-    if ( consider_focused_states ) {
-        focus = get_focused_window( ghost );
+    active = active_window_from_reply( reply );
+    if ( active == ghost->focused_win ) {
+        return true;
     }
 
-    ght_map_for_each( ghost->win_map, &iter, ght_win, ght_window_t * ) {
-        /* decide if we should use the normal or focused opacity setting */
-        opacity = ght_win->normal_opacity;
-        if ( focus == ght_win->win || focus == ght_win->target_win ) {
-            opacity = ght_win->focus_opacity;
-        }
+    debug( "[poll_active_window] Active window changed from 0x%x to 0x%x\n",
+           ghost->focused_win, active );
 
-        apply_opacity( ghost, ght_win, opacity );
+    if ( ghost->focused_win ) {
+        note_focus_change( ghost, ghost->focused_win );
+    }
+    if ( active ) {
+        note_focus_change( ghost, active );
     }
+    ghost->focused_win = active;
+
+    return true;
 }
 
 /*
@@ -627,16 +2965,26 @@ handle_event( ghost_t *ghost, xcb_generic_event_t *event )
 
             debug( "[handle_event] Window created: 0x%x\n", create_evt->window );
 
-            /* check if this window matches our rules */
-            ght_window_t *ght_win = check_window( ghost, create_evt->window );
-            if ( ght_win != NULL ) {
-                track_window( ghost, ght_win );
+            set_parent( ghost, create_evt->window, create_evt->parent );
 
-                /* register for focus events from the target window */
-                register_for_events( ghost, ght_win->target_win, XCB_EVENT_MASK_FOCUS_CHANGE );
+            /* menus, tooltips and the like are dropped without a round trip */
+            if ( create_evt->override_redirect && !ghost->match_all_windows ) {
+                break;
+            }
 
-                /* apply the initial normal opacity */
-                apply_opacity( ghost, ght_win, ght_win->normal_opacity );
+            /* match the window once it is ready */
+            defer_window( ghost, create_evt->window );
+            break;
+        }
+        /* clients set their properties before mapping their windows */
+        case XCB_MAP_NOTIFY: {
+            xcb_map_notify_event_t *map_evt =
+                (xcb_map_notify_event_t *) event;
+
+            if ( stop_pending( ghost, map_evt->window )
+                    && ( !map_evt->override_redirect || ghost->match_all_windows )) {
+                debug( "[handle_event] Pending window mapped: 0x%x\n", map_evt->window );
+                queue_evaluation( ghost, map_evt->window );
             }
             break;
         }
@@ -650,16 +2998,31 @@ handle_event( ghost_t *ghost, xcb_generic_event_t *event )
                 (xcb_reparent_notify_event_t *) event;
             debug( "[handle_event] Window reparented: 0x%x\n", reparent_evt->window );
 
-            /* check if this is a tracked window */
-            ght_window_t *ght_win = find_window( ghost, reparent_evt->window );
-            if ( ght_win != NULL ) {
-                reparent_window( ghost, ght_win, get_top_window( ghost, ght_win->win ));
+            /*
+             * Windows moved back to the root window report their reparenting
+             * to the root window as well, so skip repeats of the same move.
+             */
+            bool moved = lookup_parent( ghost, reparent_evt->window ) != reparent_evt->parent;
+            set_parent( ghost, reparent_evt->window, reparent_evt->parent );
 
-                /* register for focus events from the target window */
-                register_for_events( ghost, ght_win->target_win, XCB_EVENT_MASK_FOCUS_CHANGE );
+            /* windows moved to or from the root window need other events */
+            if ( moved ) {
+                update_window_events( ghost, reparent_evt->window );
+            }
 
-                /* apply the initial normal opacity */
-                apply_opacity( ghost, ght_win, ght_win->normal_opacity );
+            /*
+             * Tracked windows follow their new top-level window. If the
+             * chain up to it is not known, it is walked asynchronously by
+             * an evaluation rather than waited for here.
+             */
+            ght_window_t *ght_win = find_window( ghost, reparent_evt->window );
+            if ( ght_win != NULL ) {
+                xcb_window_t target = known_top_window( ghost, ght_win->win );
+                if ( target == 0 ) {
+                    queue_retarget( ghost, ght_win->win );
+                } else if ( target != ght_win->target_win ) {
+                    retarget_window( ghost, ght_win, target );
+                }
             }
             break;
         }
@@ -668,10 +3031,8 @@ handle_event( ghost_t *ghost, xcb_generic_event_t *event )
                 (xcb_focus_in_event_t *) event;
             debug( "[handle_event] Focus in: 0x%x\n", in->event );
 
-            ght_window_t *ght_win = find_window_by_target( ghost, in->event );
-            if ( ght_win != NULL ) {
-                apply_opacity( ghost, ght_win, ght_win->focus_opacity );
-            }
+            ghost->focused_win = in->event;
+            note_focus_change( ghost, in->event );
             break;
         }
         case XCB_FOCUS_OUT : {
@@ -679,11 +3040,42 @@ handle_event( ghost_t *ghost, xcb_generic_event_t *event )
                 (xcb_focus_out_event_t *) event;
             debug( "[handle_event] Focus out: 0x%x\n", out->event );
 
-            ght_window_t *ght_win = find_window_by_target( ghost, out->event );
-            if ( ght_win != NULL ) {
-                apply_opacity( ghost, ght_win, ght_win->normal_opacity );
+            if ( ghost->focused_win == out->event ) {
+                ghost->focused_win = 0;
+            }
+            note_focus_change( ghost, out->event );
+            break;
+        }
+        case XCB_PROPERTY_NOTIFY : {
+            xcb_property_notify_event_t *prop_evt =
+                (xcb_property_notify_event_t *) event;
+
+            /* the root window only reports the active window */
+            if ( prop_evt->window == ghost->winroot ) {
+                if ( ghost->use_active_window
+                        && prop_evt->atom == ghost->active_window_atom ) {
+                    refresh_active_window( ghost );
+                }
+                break;
+            }
+
+            /* ignore properties that the rules do not use */
+            if ( ghost->ruleset == NULL
+                    || ght_ruleset_atom_index( ghost->ruleset, prop_evt->atom ) < 0 ) {
+                break;
+            }
+
+            debug( "[handle_event] Property 0x%x changed on window 0x%x\n",
+                   prop_evt->atom, prop_evt->window );
+
+            prop_cache_t *cache = ght_map_get( ghost->prop_cache, &(prop_evt->window) );
+            if ( cache != NULL ) {
+                invalidate_cached_prop( cache, prop_evt->atom );
             }
+            drop_negative_match( ghost, prop_evt->window );
 
+            /* only this window needs to be matched again */
+            queue_evaluation( ghost, prop_evt->window );
             break;
         }
         case XCB_DESTROY_NOTIFY : {
@@ -691,6 +3083,17 @@ handle_event( ghost_t *ghost, xcb_generic_event_t *event )
                 (xcb_destroy_notify_event_t *) event;
             debug( "[handle_event] Window destroyed: 0x%x\n", destroy_evt->window );
 
+            cancel_evaluation( ghost, destroy_evt->window );
+            drop_prop_cache( ghost, destroy_evt->window );
+            drop_negative_match( ghost, destroy_evt->window );
+            stop_pending( ghost, destroy_evt->window );
+            forget_parent( ghost, destroy_evt->window );
+            if ( ghost->parent_count > ghost->parent_prune_at ) {
+                prune_parent_map( ghost );
+            }
+            ght_map_remove( ghost->applied_opacity_map, &(destroy_evt->window) );
+            ght_map_remove( ghost->event_mask_map, &(destroy_evt->window) );
+
             /* try to find the window by id or target id */
             ght_window_t *ght_win = find_window( ghost, destroy_evt->window );
             if ( ght_win == NULL ) {
@@ -700,6 +3103,7 @@ handle_event( ghost_t *ghost, xcb_generic_event_t *event )
             if ( ght_win != NULL ) {
                 debug( "[handle_event] Untracking window: win= 0x%x, target_win= 0x%x\n",
                        ght_win->win, ght_win->target_win );
+                drop_prop_cache( ghost, ght_win->win );
                 untrack_window( ghost, ght_win );
             }
             break;
@@ -707,23 +3111,229 @@ handle_event( ghost_t *ghost, xcb_generic_event_t *event )
     }
 }
 
+/*
+ * Returns the window the given event is about, or 0 for other events.
+ */
+static xcb_window_t
+event_window( xcb_generic_event_t *event )
+{
+    switch ( event->response_type & ~0x80 ) {
+        case XCB_CREATE_NOTIFY:
+            return ((xcb_create_notify_event_t *) event)->window;
+        case XCB_MAP_NOTIFY:
+            return ((xcb_map_notify_event_t *) event)->window;
+        case XCB_REPARENT_NOTIFY:
+            return ((xcb_reparent_notify_event_t *) event)->window;
+        case XCB_FOCUS_IN:
+            return ((xcb_focus_in_event_t *) event)->event;
+        case XCB_FOCUS_OUT:
+            return ((xcb_focus_out_event_t *) event)->event;
+        case XCB_PROPERTY_NOTIFY:
+            return ((xcb_property_notify_event_t *) event)->window;
+        case XCB_DESTROY_NOTIFY:
+            return ((xcb_destroy_notify_event_t *) event)->window;
+    }
+
+    return 0;
+}
+
+/*
+ * Appends the event to the batch, growing it as needed.
+ */
+static void
+add_to_batch( event_batch_t *batch, xcb_generic_event_t *event )
+{
+    if ( batch->count == batch->capacity ) {
+        batch->capacity = batch->capacity > 0 ? batch->capacity * 2 : 16;
+        batch->events = checked_realloc( batch->events,
+                                         batch->capacity * sizeof( xcb_generic_event_t * ));
+    }
+    batch->events[batch->count++] = event;
+}
+
+/*
+ * Adds the events already in the event queue to the batch without
+ * reading the connection. Returns true if any event was added.
+ */
+static bool
+read_queued_events( ghost_t *ghost, event_batch_t *batch )
+{
+    xcb_generic_event_t *event;
+    bool any = false;
+
+    while (( event = xcb_poll_for_queued_event( ghost->conn ))) {
+        add_to_batch( batch, event );
+        any = true;
+    }
+
+    return any;
+}
+
+/*
+ * Adds the events waiting on the connection to the batch. The connection
+ * is read once; the rest of the events are taken from the event queue.
+ */
+static void
+read_event_batch( ghost_t *ghost, event_batch_t *batch )
+{
+    xcb_generic_event_t *event = xcb_poll_for_event( ghost->conn );
+
+    if ( event ) {
+        add_to_batch( batch, event );
+        read_queued_events( ghost, batch );
+    }
+}
+
+/*
+ * Handles the events in the batch and empties it. Events about a window
+ * that is destroyed later in the batch are dropped, since the destruction
+ * undoes anything they would do; windows created and destroyed within
+ * the batch are never looked at. Focus changes are only noted here and
+ * are applied by apply_focus_changes().
+ */
+static void
+handle_event_batch( ghost_t *ghost, event_batch_t *batch )
+{
+    map_t *destroyed = NULL;
+    xcb_window_t win;
+    uintptr_t last_destroy;
+    int dropped = 0;
+    int i;
+
+    if ( batch->count < 1 ) {
+        return;
+    }
+
+    /* find the last destruction of each window in the batch, if any */
+    for ( i=0; i<batch->count; i++ ) {
+        if ( ( batch->events[i]->response_type & ~0x80 ) == XCB_DESTROY_NOTIFY ) {
+            if ( destroyed == NULL ) {
+                destroyed = ght_winmap_create( MAP_SIZE_SM );
+            }
+            win = event_window( batch->events[i] );
+            ght_map_put( destroyed, &win, (void *) (uintptr_t) ( i + 1 ));
+        }
+    }
+
+    for ( i=0; i<batch->count; i++ ) {
+        last_destroy = 0;
+        if ( destroyed != NULL ) {
+            win = event_window( batch->events[i] );
+            last_destroy = (uintptr_t) ght_map_get( destroyed, &win );
+        }
+
+        if ( last_destroy > (uintptr_t) ( i + 1 )) {
+            dropped++;
+        } else {
+            handle_event( ghost, batch->events[i] );
+        }
+
+        free( batch->events[i] );
+    }
+
+    if ( dropped > 0 ) {
+        debug( "[handle_event_batch] Dropped %d of %d events for destroyed windows\n",
+               dropped, batch->count );
+    }
+
+    batch->count = 0;
+
+    if ( destroyed != NULL ) {
+        ght_map_free( destroyed );
+    }
+}
+
 void
 ght_monitor( ghost_t *ghost )
 {
-    /* go through any existing windows and register for their events */
+    /*
+     * Go through the existing windows and register for their events. Every
+     * tracked window has cached properties, as does every other window that
+     * may match once its properties change.
+     */
     ght_window_t *existing_win;
+    map_entry_t *entry;
     map_iter_t iter;
-    ght_map_for_each( ghost->win_map, &iter, existing_win, ght_window_t * ) {
-        register_for_events( ghost, existing_win->target_win, XCB_EVENT_MASK_FOCUS_CHANGE );
+    xcb_get_property_reply_t *reply;
+    uint32_t root_events = XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+    ghost->monitoring = true;
+
+    /*
+     * Follow the focus through the active window if asked to and the
+     * window manager maintains it; otherwise watch every target window.
+     */
+    if ( ghost->use_active_window ) {
+        reply = NULL;
+        if ( ghost->active_window_atom != XCB_ATOM_NONE ) {
+            reply = xcb_get_property_reply( ghost->conn, request_active_window( ghost ), NULL );
+        }
+        if ( reply && reply->type == XCB_ATOM_WINDOW ) {
+            ghost->focused_win = active_window_from_reply( reply );
+            root_events |= XCB_EVENT_MASK_PROPERTY_CHANGE;
+        } else {
+            warn( "The window manager does not set %s; using focus events\n", ACTIVE_WINDOW );
+            free( reply );
+            ghost->use_active_window = false;
+        }
+    }
+
+    ght_map_for_each_entry( ghost->prop_cache, &iter, entry ) {
+        existing_win = find_window( ghost, *((xcb_window_t *) entry->key) );
+        if ( existing_win != NULL ) {
+            register_window_events( ghost, existing_win );
+        } else {
+            watch_window( ghost, *((xcb_window_t *) entry->key) );
+        }
     }
 
-    /* register for child events on the root window */
-    register_for_events( ghost, ghost->winroot, XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY );
+    /* register for child events, and active window changes, on the root window */
+    register_for_events( ghost, ghost->winroot, root_events );
 
-    /* wait for new window events; loop forever */
-    xcb_generic_event_t *event;
-    while ( event = xcb_wait_for_event( ghost->conn )) {
-        handle_event( ghost, event );
-        free( event );
+    /* focus changes are followed through events from here on */
+    if ( !ghost->use_active_window ) {
+        ghost->focused_win = get_focused_window( ghost );
+    }
+
+    /*
+     * Wait for new window events, waking up in time for any deferred
+     * matches and settled focus changes; loop until the connection fails.
+     */
+    event_batch_t batch = { NULL, 0, 0 };
+    unsigned long reported_writes = ghost->opacity_writes_saved;
+    uint64_t report_time = current_time_ms();
+    bool progress;
+    while ( !xcb_connection_has_error( ghost->conn )) {
+        /*
+         * Polling for one reply, and flushing, may read others, and events,
+         * off the connection, where waiting on it would not see them. Go
+         * round until a pass finds nothing new, and so sends nothing,
+         * before waiting. Deadlines are checked on every pass so that a
+         * steady stream of events does not hold up deferred matches or
+         * the settled focus.
+         */
+        do {
+            progress = run_deferred_matches( ghost );
+
+            read_event_batch( ghost, &batch );
+            progress |= batch.count > 0;
+            handle_event_batch( ghost, &batch );
+
+            progress |= run_evaluations( ghost );
+            progress |= poll_active_window( ghost );
+            progress |= collect_request_errors( ghost, false );
+            progress |= apply_focus_changes( ghost );
+
+            /* send everything from this pass at once */
+            xcb_flush( ghost->conn );
+
+            /* the polls and the flush may have queued events off the connection */
+            progress |= read_queued_events( ghost, &batch );
+        } while ( progress );
+
+        report_saved_writes( ghost, &reported_writes, &report_time );
+
+        wait_for_events( ghost, next_wakeup_timeout( ghost ));
     }
+
+    free( batch.events );
 }
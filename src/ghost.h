@@ -50,6 +50,18 @@
 /* The maximum string length allowed in rule matching operations. */
 #define MAX_STR_LEN 64
 
+/*
+ * The default maximum number of requests kept in flight at once while
+ * scanning the window tree.
+ */
+#define DEFAULT_SCAN_MAX_REQUESTS 256
+
+/*
+ * The default maximum number of windows evaluated against the rules at
+ * once while monitoring.
+ */
+#define DEFAULT_EVAL_MAX_IN_FLIGHT 32
+
 /*
  * Primary struct for tracking windows in ghost.
  */
@@ -82,6 +94,14 @@ typedef struct ght_matcher_t {
 
 	/* The value to match against */
 	char value[MAX_STR_LEN + 1];
+
+	/*
+	 * The lowercase form of value along with its length and hash, computed
+	 * once when the matcher is parsed so that matching never refolds it.
+	 */
+	char folded_value[MAX_STR_LEN + 1];
+	int value_len;
+	unsigned int value_hash;
 } ght_matcher_t;
 
 /*
@@ -100,6 +120,24 @@ typedef struct ght_rule_t {
 	float normal_opacity;
 } ght_rule_t;
 
+/*
+ * Controls how far the window tree is searched when scanning it for
+ * windows that match the rules.
+ */
+typedef struct ght_scan_policy_t {
+    /*
+     * The deepest tree level to search, where the children of the root
+     * are at depth 1, or -1 to search the whole tree.
+     */
+    int max_depth;
+
+    /* If true, unmapped windows and their descendants are not searched */
+    bool skip_unmapped;
+
+    /* If true, the descendants of matching windows are not searched */
+    bool stop_at_match;
+} ght_scan_policy_t;
+
 /*
  * Primary ghost structure.
  */
@@ -113,8 +151,18 @@ typedef struct ghost_t {
 	/* The opacity atom */
 	xcb_atom_t opacity_atom;
 
-	/* The list of rules for applying to windows */
-	list_t rules;
+	/* The EWMH client list atoms */
+	xcb_atom_t client_list_atom;
+	xcb_atom_t client_list_stacking_atom;
+
+	/* The EWMH active window atom */
+	xcb_atom_t active_window_atom;
+
+    /*
+     * The rules for applying to windows, compiled for matching;
+     * NULL if no rules are loaded
+     */
+    struct ght_ruleset_t *ruleset;
 
     /*
      * Mapping between xcb_window_t and ght_window_t to keep track
@@ -129,6 +177,167 @@ typedef struct ghost_t {
      * so the ght_window_t memory locations should only be freed once.
      */
 	map_t *target_win_map;
+
+    /*
+     * Mapping between target windows and the opacity property value last
+     * written to them, stored directly in the map value. Used to skip
+     * writing the same value again, whichever tracked window it is for.
+     */
+	map_t *applied_opacity_map;
+
+    /*
+     * Mapping between windows and the event mask selected on them, stored
+     * directly in the map value. A window can be watched and be the focus
+     * target of a tracked window at once, and selecting events replaces
+     * the whole mask, so the union of what each role needs is kept here.
+     */
+	map_t *event_mask_map;
+
+    /*
+     * The maximum number of requests sent before their replies are
+     * collected when loading the windows: tree queries, window attributes
+     * and match properties. A window whose requests alone exceed it is
+     * still loaded, one window at a time.
+     */
+    int scan_max_requests;
+
+    /* The policy used when scanning the window tree */
+    ght_scan_policy_t scan_policy;
+
+    /*
+     * Mapping between xcb_window_t and the cached match properties of
+     * tracked windows. An entry is invalidated when a PropertyNotify event
+     * reports a change to one of the properties used by the rules.
+     */
+    map_t *prop_cache;
+
+    /*
+     * Mapping between xcb_window_t and the deferred match state of new
+     * windows that have not matched a rule yet, and the earliest deadline
+     * among them, or 0 if none is pending. The deadline may be earlier
+     * than that of any window still pending, never later.
+     */
+    map_t *pending_map;
+    uint64_t pending_deadline;
+
+    /*
+     * Mapping between xcb_window_t and a record that the window matched
+     * no rule, so it can be skipped with a single lookup. Records from
+     * before the last rule reload (see rule_generation) are ignored.
+     */
+    map_t *negative_cache;
+
+    /*
+     * Mapping between xcb_window_t and the xcb_window_t of its parent,
+     * stored directly as the map value. Used to find the top-level
+     * window of a window without asking the server.
+     */
+    map_t *parent_map;
+
+    /*
+     * The number of entries in the parent map, and the number above which
+     * the entries left behind by destroyed windows are pruned.
+     */
+    int parent_count;
+    int parent_prune_at;
+
+    /*
+     * Mapping between xcb_window_t and the state of the window's
+     * evaluation against the rules while monitoring. The evaluations wait
+     * for a slot in eval_queue, in order, and up to eval_max_in_flight of
+     * them have requests in flight at once; eval_in_flight counts those.
+     */
+    map_t *eval_map;
+    win_array_t eval_queue;
+    int eval_max_in_flight;
+    int eval_in_flight;
+
+    /*
+     * The checked requests sent without waiting for their errors, in
+     * the order they were sent. Their errors are collected once the
+     * server has answered them.
+     */
+    struct checked_request_t *checked_requests;
+    int checked_count;
+    int checked_capacity;
+
+    /* The number of opacity writes skipped because nothing changed */
+    unsigned long opacity_writes_saved;
+
+    /* Incremented every time rules are loaded */
+    unsigned int rule_generation;
+
+    /*
+     * If true, ght_load_windows() always scans the whole window tree. If
+     * false, it only checks the clients in the root window's EWMH client
+     * list when the window manager provides one.
+     */
+    bool scan_tree;
+
+    /*
+     * If true, override-redirect windows (menus, tooltips and the like)
+     * and InputOnly windows are matched like any other window. If false,
+     * they are skipped without fetching their properties.
+     */
+    bool match_all_windows;
+
+    /*
+     * If true, ght_load_windows() applies the opacity of each matching
+     * window as soon as it is found, giving the window with the input
+     * focus its focus opacity.
+     */
+    bool apply_on_load;
+
+    /*
+     * If true, ght_load_windows() selects the watch events of each window
+     * before its properties are requested, so that a change made after
+     * the fetch is reported once ght_monitor() runs. Set when loading the
+     * windows for monitoring.
+     */
+    bool watch_on_load;
+
+    /*
+     * If true, ght_load_windows() does not track the matching windows;
+     * it sets the normal opacity of each one as soon as its match is
+     * resolved, caches nothing and flushes the requests once at the end.
+     * Used for single-pass runs, where the windows are not needed later.
+     */
+    bool streaming;
+
+    /* The window with the input focus as last checked or reported */
+    xcb_window_t focused_win;
+
+    /*
+     * If true, ght_monitor() follows the focus through the root window's
+     * _NET_ACTIVE_WINDOW property, so that only the root window reports
+     * focus changes, instead of selecting focus events on every target
+     * window. It falls back to focus events if the window manager does not
+     * set the property.
+     */
+    bool use_active_window;
+
+    /* The request for the new active window, if one is in flight */
+    xcb_get_property_cookie_t active_window_cookie;
+    bool active_window_pending;
+
+    /*
+     * The number of milliseconds ght_monitor() waits for the focus to
+     * settle before applying focus opacities, or 0 to apply them as soon
+     * as each event batch is handled. Focus changes within this time are
+     * collapsed into their final state; the first change is never applied
+     * later than this.
+     */
+    int focus_debounce;
+
+    /*
+     * The windows whose focus changed since the focus opacities were last
+     * applied, and the time they are due to be applied.
+     */
+    win_array_t focus_changes;
+    uint64_t focus_deadline;
+
+    /* True once ght_monitor() is processing events */
+    bool monitoring;
 } ghost_t;
 
 /*
@@ -159,21 +368,15 @@ ght_load_rule_str( ghost_t *ghost, char *rulestr );
 
 /*
  * Searches all existing x windows for ones matching the rulea and
- * adds them to the tracked list.
+ * adds them to the tracked list. Only the clients listed by the window
+ * manager are searched if possible (see scan_tree). Visible windows are
+ * searched first, from the top of the stack down, and have their opacity
+ * applied right away if apply_on_load is set. If streaming is set, the
+ * windows are not tracked and their normal opacity is applied instead.
  */
 void
 ght_load_windows( ghost_t *ghost );
 
-/*
- * Applies opacity settings to the current set of tracked windows. If
- * consider_focus_states is true, then the current window with the input
- * focus will use the focus_opacity setting while all other windows will
- * receive the normal_opacity setting. If false, all windows will receive
- * the normal_opacity setting.
- */
-void
-ght_apply_opacity_settings( ghost_t *ghost, bool consider_focus_states );
-
 /*
  * Enters a loop where x events are tracked and rules applied dynamically.
  * This function does not return.
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 
 /* ################### GENERAL ####################### */
 
@@ -22,6 +23,19 @@ checked_malloc( size_t size )
     return result;
 }
 
+void *
+checked_realloc( void *ptr, size_t size )
+{
+    void *result = realloc( ptr, size );
+    if ( result == NULL ) {
+        fprintf( stderr,
+                 "Fatal Error: Failed to allocate dynamic memory!\n" );
+        exit( EXIT_FAILURE );
+    }
+
+    return result;
+}
+
 /* ####################### LISTS ###################### */
 
 void
@@ -75,6 +89,48 @@ ght_list_iter_next( list_iter_t *iter )
     return iter->current;
 }
 
+/* ################## WINDOW ARRAYS #################### */
+
+void
+ght_win_array_push( win_array_t *array, xcb_window_t win )
+{
+    ght_win_array_push_all( array, &win, 1 );
+}
+
+void
+ght_win_array_push_all( win_array_t *array, xcb_window_t *wins, int count )
+{
+    int capacity = array->capacity > 0 ? array->capacity : WIN_ARRAY_INITIAL_SIZE;
+
+    while ( capacity < array->count + count ) {
+        capacity *= 2;
+    }
+
+    if ( capacity != array->capacity ) {
+        array->items = checked_realloc( array->items, capacity * sizeof( xcb_window_t ));
+        array->capacity = capacity;
+    }
+
+    memcpy( array->items + array->count, wins, count * sizeof( xcb_window_t ));
+    array->count += count;
+}
+
+void
+ght_win_array_clear( win_array_t *array )
+{
+    array->count = 0;
+}
+
+void
+ght_win_array_free( win_array_t *array )
+{
+    free( array->items );
+
+    array->items = NULL;
+    array->count = 0;
+    array->capacity = 0;
+}
+
 /* ########################## MAPS ###################### */
 
 /* Helper function for creating a map_entry_t element. */
@@ -321,6 +377,27 @@ ght_strmap_create( int buckets_size )
                            ght_strmap_key_copy);
 }
 
+int
+ght_str_fold( char *dst, const char *src, int len, unsigned int *hash )
+{
+    unsigned int h = 5381;
+    int i;
+
+    for ( i=0; i<len && src[i] != '\0'; i++ ) {
+        dst[i] = tolower( (unsigned char) src[i] );
+
+        /* same djb2 hash as ght_strmap_key_hash */
+        h = (( h << 5 ) + h ) + dst[i];
+    }
+    dst[i] = '\0';
+
+    if ( hash != NULL ) {
+        *hash = h;
+    }
+
+    return i;
+}
+
 /* ########## Map<xcb_window_t, void *> ########## */
 
 unsigned int
@@ -19,6 +19,13 @@
 void *
 checked_malloc( size_t size );
 
+/*
+ * Reallocation function that fails the program if the memory
+ * cannot be resized. Any new memory is not initialized.
+ */
+void *
+checked_realloc( void *ptr, size_t size );
+
 /* ################### Lists ########################## */
 
 /*
@@ -118,6 +125,45 @@ ght_list_iter_init( list_t *list, list_iter_t *iter );
 list_node_t *
 ght_list_iter_next( list_iter_t *iter );
 
+/* ################## Window arrays ####################### */
+
+/* Initial capacity of a window array's item buffer */
+#define WIN_ARRAY_INITIAL_SIZE 16
+
+/*
+ * Growable array of xcb_window_t values, useful for collecting windows
+ * in bulk. A zeroed struct is a valid, empty array.
+ */
+typedef struct win_array_t {
+    /* the window ids */
+    xcb_window_t *items;
+
+    /* the number of windows in the array */
+    int count;
+
+    /* the number of windows that fit in items before it must grow */
+    int capacity;
+} win_array_t;
+
+/* Adds a window to the end of the array, growing it if needed. */
+void
+ght_win_array_push( win_array_t *array, xcb_window_t win );
+
+/* Adds count windows from wins to the end of the array. */
+void
+ght_win_array_push_all( win_array_t *array, xcb_window_t *wins, int count );
+
+/* Removes all windows from the array without releasing its memory. */
+void
+ght_win_array_clear( win_array_t *array );
+
+/*
+ * Releases the memory held by the array. The array struct itself is
+ * not freed and may be reused as an empty array.
+ */
+void
+ght_win_array_free( win_array_t *array );
+
 /* ####################### MAPS ########################## */
 
 /* Pre-defined, prime map bucket array sizes */
@@ -296,6 +342,16 @@ ght_strmap_key_copy( void * key );
 map_t *
 ght_strmap_create( int buckets_size );
 
+/*
+ * Copies the lowercase form of at most len characters of src into dst,
+ * stopping early at a null character, and null terminates dst. dst must
+ * hold at least len + 1 characters. Returns the number of characters copied.
+ * If hash is not NULL, it receives the ght_strmap_key_hash() of the
+ * lowercase string, computed in the same pass.
+ */
+int
+ght_str_fold( char *dst, const char *src, int len, unsigned int *hash );
+
 /* xcb_window_t hashing function. This just returns the key as an int. */
 unsigned int
 ght_winmap_key_hash( void *key );
@@ -365,6 +365,9 @@ read_matcher( ght_parser_t *p )
         && match_str_token( p )
         && strncpy( m->value, p->buffer, MAX_STR_LEN )
         && match_char( p, PAREN_END )){
+        /* store the canonical form used for matching */
+        m->value_len = ght_str_fold( m->folded_value, m->value,
+                                     MAX_STR_LEN, &(m->value_hash) );
         return m;
     }
 
@@ -0,0 +1,463 @@
+/* ghost_rules.c
+ * Contains logic for compiling and matching ghost rules.
+ */
+
+#include <string.h>
+#include "ghost.h"
+#include "ghost_data.h"
+#include "ghost_rules.h"
+
+/* The smallest matcher hash table size */
+#define MIN_TABLE_SIZE 8
+
+/*
+ * A lowercased window property value stored in a memo key, along with
+ * its length and hash. The offset is -1 if the window lacks the property.
+ */
+typedef struct key_value_t {
+    int offset;
+    int len;
+    unsigned int hash;
+} key_value_t;
+
+/* ################ Helper functions ################### */
+
+/*
+ * Copies the null terminated lowercase form of the first len characters of
+ * src into dst, which must hold at least MAX_STR_LEN + 1 characters. Copying
+ * stops early at a null character. Values longer than MAX_STR_LEN are
+ * truncated, which matches the length limit used when comparing values.
+ * Returns the length of the folded value and stores its hash in *hash.
+ */
+static int
+fold_value( char *dst, const char *src, int len, unsigned int *hash )
+{
+    if ( len > MAX_STR_LEN ) {
+        len = MAX_STR_LEN;
+    }
+
+    return ght_str_fold( dst, src, len, hash );
+}
+
+/*
+ * Returns the djb2 hash of len bytes of data.
+ */
+static unsigned int
+hash_bytes( const char *data, int len )
+{
+    unsigned int hash = 5381;
+    int i;
+    for ( i=0; i<len; i++ ) {
+        hash = (( hash << 5 ) + hash ) + (unsigned char) data[i];
+    }
+    return hash;
+}
+
+/*
+ * Returns the table hash of a matcher with the given atom index and
+ * lowercased value hash.
+ */
+static inline unsigned int
+matcher_hash( int atom_idx, unsigned int value_hash )
+{
+    return value_hash ^ ( atom_idx * 31 );
+}
+
+/*
+ * Returns the index of the atom in the rule set atoms array, adding it
+ * if it is not already present.
+ */
+static int
+add_atom( ght_ruleset_t *ruleset, xcb_atom_t atom )
+{
+    int i;
+    for ( i=0; i<ruleset->atom_count; i++ ) {
+        if ( ruleset->atoms[i] == atom ) {
+            return i;
+        }
+    }
+
+    ruleset->atoms[i] = atom;
+    ruleset->atom_count++;
+
+    return i;
+}
+
+/*
+ * Returns the table slot holding the matcher with the given atom index and
+ * lowercased value of length len and hash hash, or the empty slot where it
+ * would be placed if the rule set has no such matcher. Matchers whose hash
+ * or length differ are rejected before their values are compared.
+ */
+static int
+find_slot( ght_ruleset_t *ruleset, int atom_idx, const char *folded,
+           int len, unsigned int hash )
+{
+    int mask = ruleset->table_size - 1;
+    int slot = matcher_hash( atom_idx, hash ) & mask;
+    int m;
+
+    while ( ruleset->matcher_table[slot] != 0 ) {
+        m = ruleset->matcher_table[slot] - 1;
+        if ( ruleset->matcher_hashes[m] == hash
+                && ruleset->matcher_lens[m] == len
+                && ruleset->matcher_atoms[m] == atom_idx
+                && memcmp( ruleset->value_blob + ruleset->matcher_values[m], folded, len ) == 0 ) {
+            break;
+        }
+        slot = ( slot + 1 ) & mask;
+    }
+
+    return slot;
+}
+
+/*
+ * Returns the matcher with the given atom index and lowercased value
+ * or -1 if the rule set has no such matcher.
+ */
+static int
+find_matcher( ght_ruleset_t *ruleset, int atom_idx, const char *folded,
+              int len, unsigned int hash )
+{
+    return ruleset->matcher_table[find_slot( ruleset, atom_idx, folded, len, hash )] - 1;
+}
+
+/*
+ * Returns the matcher with the given atom index and the pre-folded value
+ * of the parsed matcher, adding it to the rule set if it is not already
+ * present. *blob_len is the number of characters used in the value blob
+ * so far.
+ */
+static int
+add_matcher( ght_ruleset_t *ruleset, int atom_idx, ght_matcher_t *matcher, int *blob_len )
+{
+    int slot = find_slot( ruleset, atom_idx, matcher->folded_value,
+                          matcher->value_len, matcher->value_hash );
+    int m = ruleset->matcher_table[slot] - 1;
+
+    if ( m < 0 ) {
+        m = ruleset->matcher_count++;
+
+        ruleset->matcher_atoms[m] = atom_idx;
+        ruleset->matcher_values[m] = *blob_len;
+        ruleset->matcher_lens[m] = matcher->value_len;
+        ruleset->matcher_hashes[m] = matcher->value_hash;
+
+        memcpy( ruleset->value_blob + *blob_len, matcher->folded_value, matcher->value_len + 1 );
+        *blob_len += matcher->value_len + 1;
+
+        ruleset->matcher_table[slot] = m + 1;
+    }
+
+    return m;
+}
+
+/*
+ * Sets the given bit in the mask.
+ */
+static inline void
+mask_set( ght_mask_word_t *mask, int bit )
+{
+    mask[bit / MASK_WORD_BITS] |= ((ght_mask_word_t) 1) << ( bit % MASK_WORD_BITS );
+}
+
+/*
+ * Returns true if every bit set in mask is also set in set. Both masks
+ * are words long. The loop is kept branch free so the compiler can
+ * vectorize it.
+ */
+static inline bool
+mask_is_subset( const ght_mask_word_t *mask, const ght_mask_word_t *set, int words )
+{
+    ght_mask_word_t missing = 0;
+    int i;
+    for ( i=0; i<words; i++ ) {
+        missing |= mask[i] & ~set[i];
+    }
+    return missing == 0;
+}
+
+/*
+ * Builds the rule masks and candidate lists from the per-rule matcher
+ * ranges.
+ */
+static void
+build_masks_and_candidates( ght_ruleset_t *ruleset )
+{
+    ght_mask_word_t *mask;
+    int *next;
+    int r, i, first;
+
+    ruleset->mask_words = ( ruleset->matcher_count + MASK_WORD_BITS - 1 ) / MASK_WORD_BITS;
+    ruleset->rule_masks = checked_malloc(
+        ( ruleset->rule_count * ruleset->mask_words + 1 ) * sizeof( ght_mask_word_t ));
+    ruleset->satisfied = checked_malloc(
+        ( ruleset->mask_words + 1 ) * sizeof( ght_mask_word_t ));
+
+    ruleset->matcher_candidates = checked_malloc(( ruleset->matcher_count + 1 ) * sizeof( int ));
+    ruleset->candidates = checked_malloc(( ruleset->rule_count + 1 ) * sizeof( int ));
+
+    /* set the mask bits and count the candidates for each matcher */
+    for ( r=0; r<ruleset->rule_count; r++ ) {
+        mask = ruleset->rule_masks + r * ruleset->mask_words;
+        for ( i=ruleset->rule_matchers[r]; i<ruleset->rule_matchers[r + 1]; i++ ) {
+            mask_set( mask, ruleset->rule_matcher_bits[i] );
+        }
+
+        if ( ruleset->rule_matchers[r] < ruleset->rule_matchers[r + 1] ) {
+            first = ruleset->rule_matcher_bits[ruleset->rule_matchers[r]];
+            ruleset->matcher_candidates[first + 1]++;
+        }
+    }
+
+    /* turn the counts into start offsets */
+    for ( i=0; i<ruleset->matcher_count; i++ ) {
+        ruleset->matcher_candidates[i + 1] += ruleset->matcher_candidates[i];
+    }
+
+    /* fill in the candidates in rule order */
+    next = checked_malloc(( ruleset->matcher_count + 1 ) * sizeof( int ));
+    memcpy( next, ruleset->matcher_candidates, ruleset->matcher_count * sizeof( int ));
+
+    for ( r=0; r<ruleset->rule_count; r++ ) {
+        if ( ruleset->rule_matchers[r] < ruleset->rule_matchers[r + 1] ) {
+            first = ruleset->rule_matcher_bits[ruleset->rule_matchers[r]];
+            ruleset->candidates[next[first]++] = r;
+        }
+    }
+
+    free( next );
+}
+
+/*
+ * Builds the memo key for the given window property values into key and
+ * returns its length. For each atom, the key holds a byte that is 1 if the
+ * window has the property and 0 if not, followed by the null terminated
+ * lowercased value if present. Each value is folded exactly once; its
+ * position, length and hash within the key are stored in folded.
+ */
+static int
+build_memo_key( ght_ruleset_t *ruleset, const ght_value_t *values, char *key,
+                key_value_t *folded )
+{
+    int len = 0;
+    int i;
+
+    for ( i=0; i<ruleset->atom_count; i++ ) {
+        if ( values[i].data == NULL ) {
+            key[len++] = 0;
+            folded[i].offset = -1;
+        } else {
+            key[len++] = 1;
+            folded[i].offset = len;
+            folded[i].len = fold_value( key + len, values[i].data, values[i].len,
+                                        &(folded[i].hash) );
+
+            len += folded[i].len + 1;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * Returns the index of the first rule matched by the lowercased values
+ * in key, described by folded, or GHT_NO_RULE.
+ */
+static int
+evaluate_rules( ght_ruleset_t *ruleset, const char *key, const key_value_t *folded )
+{
+    int found[ruleset->atom_count + 1];
+    int best = ruleset->rule_count;
+    int words = ruleset->mask_words;
+    int i, c, m, r;
+
+    /*
+     * Work out which matchers the window satisfies. A property has a single
+     * value, so it satisfies at most one matcher and needs one lookup.
+     */
+    memset( ruleset->satisfied, 0, words * sizeof( ght_mask_word_t ));
+
+    for ( i=0; i<ruleset->atom_count; i++ ) {
+        found[i] = -1;
+        if ( folded[i].offset < 0 ) {
+            continue;
+        }
+
+        found[i] = find_matcher( ruleset, i, key + folded[i].offset,
+                                 folded[i].len, folded[i].hash );
+        if ( found[i] >= 0 ) {
+            mask_set( ruleset->satisfied, found[i] );
+        }
+    }
+
+    /*
+     * Check the candidate rules of each satisfied matcher. Every rule is
+     * in at most one candidate list and each list is in rule order, so the
+     * first match in a list is the only one worth considering from it.
+     */
+    for ( i=0; i<ruleset->atom_count; i++ ) {
+        m = found[i];
+        if ( m < 0 ) {
+            continue;
+        }
+
+        for ( c=ruleset->matcher_candidates[m]; c<ruleset->matcher_candidates[m + 1]; c++ ) {
+            r = ruleset->candidates[c];
+            if ( r >= best ) {
+                break;
+            }
+
+            if ( mask_is_subset( ruleset->rule_masks + r * words,
+                                 ruleset->satisfied, words )) {
+                best = r;
+                break;
+            }
+        }
+    }
+
+    return best < ruleset->rule_count ? best : GHT_NO_RULE;
+}
+
+/* ################## Public Methods ################## */
+
+ght_ruleset_t *
+ght_ruleset_create( list_t *rules )
+{
+    ght_ruleset_t *ruleset = checked_malloc( sizeof( ght_ruleset_t ));
+    ght_rule_t *rule;
+    ght_matcher_t *matcher;
+    int total_matchers = 0;
+    int blob_len = 0;
+    int r, n;
+
+    /* count everything so the arrays can be allocated up front */
+    ght_list_for_each( rules, rule, ght_rule_t ) {
+        ght_list_for_each( &(rule->matchers), matcher, ght_matcher_t ) {
+            total_matchers++;
+            blob_len += matcher->value_len + 1;
+        }
+        ruleset->rule_count++;
+    }
+
+    ruleset->table_size = MIN_TABLE_SIZE;
+    while ( ruleset->table_size < total_matchers * 2 ) {
+        ruleset->table_size *= 2;
+    }
+
+    ruleset->atoms = checked_malloc(( total_matchers + 1 ) * sizeof( xcb_atom_t ));
+    ruleset->matcher_atoms = checked_malloc(( total_matchers + 1 ) * sizeof( int ));
+    ruleset->matcher_values = checked_malloc(( total_matchers + 1 ) * sizeof( int ));
+    ruleset->matcher_lens = checked_malloc(( total_matchers + 1 ) * sizeof( int ));
+    ruleset->matcher_hashes = checked_malloc(( total_matchers + 1 ) * sizeof( unsigned int ));
+    ruleset->value_blob = checked_malloc( blob_len + 1 );
+    ruleset->matcher_table = checked_malloc( ruleset->table_size * sizeof( int ));
+
+    ruleset->rule_matchers = checked_malloc(( ruleset->rule_count + 1 ) * sizeof( int ));
+    ruleset->rule_matcher_bits = checked_malloc(( total_matchers + 1 ) * sizeof( int ));
+    ruleset->focus_opacity = checked_malloc(( ruleset->rule_count + 1 ) * sizeof( float ));
+    ruleset->normal_opacity = checked_malloc(( ruleset->rule_count + 1 ) * sizeof( float ));
+
+    /* copy the rules, assigning atoms and bits to every distinct matcher */
+    r = 0;
+    n = 0;
+    blob_len = 0;
+    ght_list_for_each( rules, rule, ght_rule_t ) {
+        ruleset->rule_matchers[r] = n;
+        ruleset->focus_opacity[r] = rule->focus_opacity;
+        ruleset->normal_opacity[r] = rule->normal_opacity;
+
+        ght_list_for_each( &(rule->matchers), matcher, ght_matcher_t ) {
+            ruleset->rule_matcher_bits[n++] =
+                add_matcher( ruleset,
+                             add_atom( ruleset, matcher->name_atom ),
+                             matcher, &blob_len );
+        }
+
+        r++;
+    }
+    ruleset->rule_matchers[r] = n;
+
+    build_masks_and_candidates( ruleset );
+
+    /* each value in a memo key takes at most a flag, MAX_STR_LEN chars and a null */
+    ruleset->memo_key_size = ruleset->atom_count * ( MAX_STR_LEN + 2 );
+    ruleset->memo = checked_malloc( MEMO_SIZE * sizeof( ght_memo_entry_t ));
+    ruleset->memo_keys = checked_malloc( MEMO_SIZE * ruleset->memo_key_size + 1 );
+    ruleset->memo_scratch = checked_malloc( ruleset->memo_key_size + 1 );
+
+    debug( "[ght_ruleset_create] Compiled %d rules using %d distinct properties "
+           "and %d distinct matchers\n",
+           ruleset->rule_count, ruleset->atom_count, ruleset->matcher_count );
+
+    return ruleset;
+}
+
+void
+ght_ruleset_free( ght_ruleset_t *ruleset )
+{
+    if ( ruleset == NULL ) {
+        return;
+    }
+
+    free( ruleset->atoms );
+    free( ruleset->matcher_atoms );
+    free( ruleset->matcher_values );
+    free( ruleset->matcher_lens );
+    free( ruleset->matcher_hashes );
+    free( ruleset->value_blob );
+    free( ruleset->matcher_candidates );
+    free( ruleset->candidates );
+    free( ruleset->rule_matchers );
+    free( ruleset->rule_matcher_bits );
+    free( ruleset->focus_opacity );
+    free( ruleset->normal_opacity );
+    free( ruleset->rule_masks );
+    free( ruleset->matcher_table );
+    free( ruleset->satisfied );
+    free( ruleset->memo );
+    free( ruleset->memo_keys );
+    free( ruleset->memo_scratch );
+    free( ruleset );
+}
+
+int
+ght_ruleset_atom_index( ght_ruleset_t *ruleset, xcb_atom_t atom )
+{
+    int i;
+    for ( i=0; i<ruleset->atom_count; i++ ) {
+        if ( ruleset->atoms[i] == atom ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int
+ght_ruleset_match( ght_ruleset_t *ruleset, const ght_value_t *values )
+{
+    key_value_t folded[ruleset->atom_count + 1];
+    char *key = ruleset->memo_scratch;
+    int key_len = build_memo_key( ruleset, values, key, folded );
+    unsigned int hash = hash_bytes( key, key_len );
+    int slot = hash & ( MEMO_SIZE - 1 );
+    ght_memo_entry_t *entry = ruleset->memo + slot;
+    char *entry_key = ruleset->memo_keys + slot * ruleset->memo_key_size;
+
+    if ( entry->key_len == key_len
+            && entry->hash == hash
+            && memcmp( entry_key, key, key_len ) == 0 ) {
+        ruleset->memo_hits++;
+        return entry->rule;
+    }
+
+    ruleset->memo_misses++;
+
+    /* evaluate the rules and remember the result, replacing any old entry */
+    entry->rule = evaluate_rules( ruleset, key, folded );
+    entry->hash = hash;
+    entry->key_len = key_len;
+    memcpy( entry_key, key, key_len );
+
+    return entry->rule;
+}
@@ -0,0 +1,180 @@
+/* ghost_rules.h
+ *
+ * Header file for the compiled form of the ghost rules. Once the rules
+ * have been parsed and their matcher atoms looked up, they are compiled
+ * into a packed, read-only rule set that can be matched quickly against
+ * the property values fetched from a window. The rule set does not refer
+ * back to the parsed rule list, which can be freed once it is compiled.
+ */
+
+#ifndef _GHOST_RULES_H_
+#define _GHOST_RULES_H_
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+#include "ghost.h"
+#include "ghost_data.h"
+
+/* Value returned by ght_ruleset_match() when no rule matches */
+#define GHT_NO_RULE -1
+
+/*
+ * A window property value. The data is not null terminated and may point
+ * straight into an X reply; only the characters before the first null (if
+ * any) are used. A NULL data pointer means the window lacks the property.
+ */
+typedef struct ght_value_t {
+    const char *data;
+    int len;
+} ght_value_t;
+
+/* The type of a single word in a rule bit mask */
+typedef uint64_t ght_mask_word_t;
+
+/* The number of bits in a ght_mask_word_t */
+#define MASK_WORD_BITS 64
+
+/* The number of entries in the match memo; must be a power of two */
+#define MEMO_SIZE 256
+
+/*
+ * Entry in the match memo. The key is the tuple of lowercased window
+ * property values that was matched and is stored separately in the
+ * rule set memo_keys array.
+ */
+typedef struct ght_memo_entry_t {
+    /* the hash of the key */
+    unsigned int hash;
+
+    /* the length of the key; zero if the entry is empty */
+    int key_len;
+
+    /* the matched rule index or GHT_NO_RULE */
+    int rule;
+} ght_memo_entry_t;
+
+/*
+ * A rule list compiled for matching. All members are stored in flat arrays.
+ * Rules are identified by their index in the original rule list and distinct
+ * matchers (ie distinct atom and case-folded value pairs) by their bit index
+ * in the rule masks.
+ */
+typedef struct ght_ruleset_t {
+    /* The number of rules */
+    int rule_count;
+
+    /*
+     * The distinct set of atoms used by the rule matchers. These are
+     * the properties that must be fetched from a window to match it.
+     */
+    xcb_atom_t *atoms;
+    int atom_count;
+
+    /* The number of distinct matchers, ie the number of bits in a mask */
+    int matcher_count;
+
+    /* The index in atoms of each matcher's atom */
+    int *matcher_atoms;
+
+    /* The offset in value_blob of each matcher's lowercased value */
+    int *matcher_values;
+
+    /* The length and hash of each matcher's lowercased value */
+    int *matcher_lens;
+    unsigned int *matcher_hashes;
+
+    /* All of the lowercased matcher values, each null terminated */
+    char *value_blob;
+
+    /*
+     * The rules whose first matcher is matcher m are stored in rule
+     * order in candidates[matcher_candidates[m]] up to (but not including)
+     * candidates[matcher_candidates[m + 1]]. A window can only match a rule
+     * if it matches its first matcher.
+     */
+    int *matcher_candidates;
+    int *candidates;
+
+    /*
+     * The matchers of rule r are stored in rule_matcher_bits[rule_matchers[r]]
+     * up to (but not including) rule_matcher_bits[rule_matchers[r + 1]].
+     */
+    int *rule_matchers;
+    int *rule_matcher_bits;
+
+    /* The opacity settings of each rule */
+    float *focus_opacity;
+    float *normal_opacity;
+
+    /* The number of ght_mask_word_t needed to hold one mask */
+    int mask_words;
+
+    /*
+     * The masks of required matcher bits for each rule, stored
+     * contiguously with mask_words words per rule.
+     */
+    ght_mask_word_t *rule_masks;
+
+    /*
+     * Open addressing hash table of the distinct matchers. Each slot holds
+     * a matcher index plus one, or zero if the slot is empty. The size is
+     * a power of two.
+     */
+    int *matcher_table;
+    int table_size;
+
+    /* Scratch mask holding the matchers satisfied by a window */
+    ght_mask_word_t *satisfied;
+
+    /*
+     * Direct mapped cache of match results, indexed by the hash of the
+     * window property value tuple. Windows with the same property values
+     * always match the same rule, so repeated tuples skip evaluation.
+     * The memo lives and dies with the rule set.
+     */
+    ght_memo_entry_t *memo;
+
+    /* The keys for the memo entries, memo_key_size bytes per entry */
+    char *memo_keys;
+    int memo_key_size;
+
+    /* Scratch buffer for building a memo key */
+    char *memo_scratch;
+
+    /* Memo statistics */
+    unsigned long memo_hits;
+    unsigned long memo_misses;
+} ght_ruleset_t;
+
+/*
+ * Compiles the given rule list into a new rule set. The name_atom member
+ * of every matcher must already be set. The rule list is not modified and
+ * is not referenced by the rule set.
+ */
+ght_ruleset_t *
+ght_ruleset_create( list_t *rules );
+
+/*
+ * Releases all memory associated with the rule set.
+ */
+void
+ght_ruleset_free( ght_ruleset_t *ruleset );
+
+/*
+ * Returns the index of the given atom in the rule set atoms array or -1
+ * if no rule matches against it.
+ */
+int
+ght_ruleset_atom_index( ght_ruleset_t *ruleset, xcb_atom_t atom );
+
+/*
+ * Returns the index of the first rule, in rule list order, that matches the
+ * given window property values or GHT_NO_RULE if none match. The values array
+ * holds one value per atom in the rule set atoms array. Values are compared
+ * in place without being copied to the heap. Results are memoized by
+ * property value tuple.
+ */
+int
+ght_ruleset_match( ght_ruleset_t *ruleset, const ght_value_t *values );
+
+#endif
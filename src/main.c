@@ -5,18 +5,37 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
 #include "ghost.h"
 
 /* Struct for passing around command line arguments */
 typedef struct cmdargs_t {
     bool help;
     bool monitor;
+    bool all_windows;
+    bool scan_tree;
+    int max_depth;
+    int max_requests;
+    bool mapped_only;
+    bool stop_at_match;
+    int focus_debounce;
+    bool active_window;
     char *rulefile;
     char *rulestr;
 } cmdargs_t;
 
 /* Struct containing command line argument defaults */
 cmdargs_t DEFAULT_ARGS = {
+    0,
+    0,
+    0,
+    0,
+    -1,
+    DEFAULT_SCAN_MAX_REQUESTS,
+    0,
+    0,
     0,
     0,
     NULL,
@@ -44,6 +63,30 @@ usage()
     fprintf( stderr,
              "   -m, --monitor   Enter monitoring mode. In this mode, the program will continuously "
              "monitor events from the X windowing system and apply opacity rules as needed.\n");
+    fprintf( stderr,
+             "   -a, --all       Also match override-redirect windows (menus, tooltips, etc) and "
+             "input-only windows. These are skipped by default.\n");
+    fprintf( stderr,
+             "   -t, --tree      Search the whole window tree for matching windows instead of "
+             "only the clients listed by the window manager.\n");
+    fprintf( stderr,
+             "   -d, --depth     Indicates that the next argument is the deepest level of the window "
+             "tree to search, where top-level windows are at depth 1. Implies -t.\n");
+    fprintf( stderr,
+             "   -r, --requests  Indicates that the next argument is the maximum number of requests "
+             "kept in flight while loading the existing windows.\n");
+    fprintf( stderr,
+             "   -u, --mapped    Do not search unmapped windows or their descendants, or unmapped "
+             "clients without -t.\n");
+    fprintf( stderr,
+             "   -s, --stop      Do not search the descendants of windows that match a rule. "
+             "Implies -t.\n");
+    fprintf( stderr,
+             "   -b, --debounce  Indicates that the next argument is the number of milliseconds to wait "
+             "for the focus to settle before applying focus opacities in monitoring mode.\n");
+    fprintf( stderr,
+             "   -w, --active    Follow the focus through the window manager's _NET_ACTIVE_WINDOW "
+             "instead of focus events from every tracked window in monitoring mode.\n");
 
     fprintf( stderr, "\n" );
     exit( 1 );
@@ -71,6 +114,61 @@ parse_args( int argc, char **argv )
             args.help = 1;
         } else if ( FLAG_COMPARE( "-m", "--monitor", argv[i] )) {
             args.monitor = 1;
+        } else if ( FLAG_COMPARE( "-a", "--all", argv[i] )) {
+            args.all_windows = 1;
+        } else if ( FLAG_COMPARE( "-t", "--tree", argv[i] )) {
+            args.scan_tree = 1;
+        } else if ( FLAG_COMPARE( "-d", "--depth", argv[i] )) {
+            char *end;
+            long depth;
+            if ( i >= argc - 1 ) {
+                error( "Depth flag given but no depth specified!\n" );
+                usage();
+            }
+            errno = 0;
+            depth = strtol( argv[++i], &end, 10 );
+            if ( *argv[i] == '\0' || *end != '\0' || errno == ERANGE
+                    || depth < 1 || depth > INT_MAX ) {
+                error( "Invalid depth: %s\n", argv[i] );
+                usage();
+            }
+            args.max_depth = depth;
+        } else if ( FLAG_COMPARE( "-r", "--requests", argv[i] )) {
+            char *end;
+            long requests;
+            if ( i >= argc - 1 ) {
+                error( "Requests flag given but no count specified!\n" );
+                usage();
+            }
+            errno = 0;
+            requests = strtol( argv[++i], &end, 10 );
+            if ( *argv[i] == '\0' || *end != '\0' || errno == ERANGE
+                    || requests < 1 || requests > INT_MAX ) {
+                error( "Invalid request count: %s\n", argv[i] );
+                usage();
+            }
+            args.max_requests = requests;
+        } else if ( FLAG_COMPARE( "-u", "--mapped", argv[i] )) {
+            args.mapped_only = 1;
+        } else if ( FLAG_COMPARE( "-s", "--stop", argv[i] )) {
+            args.stop_at_match = 1;
+        } else if ( FLAG_COMPARE( "-w", "--active", argv[i] )) {
+            args.active_window = 1;
+        } else if ( FLAG_COMPARE( "-b", "--debounce", argv[i] )) {
+            char *end;
+            long debounce;
+            if ( i >= argc - 1 ) {
+                error( "Debounce flag given but no time specified!\n" );
+                usage();
+            }
+            errno = 0;
+            debounce = strtol( argv[++i], &end, 10 );
+            if ( *argv[i] == '\0' || *end != '\0' || errno == ERANGE
+                    || debounce < 0 || debounce > INT_MAX ) {
+                error( "Invalid debounce time: %s\n", argv[i] );
+                usage();
+            }
+            args.focus_debounce = debounce;
         } else if( FLAG_COMPARE( "-f", "--file", argv[i] )) {
             if ( i >= argc - 1 || argv[i+1][0] == '-' ) {
                 error( "File flag given but no name specified!\n" );
@@ -86,6 +184,11 @@ parse_args( int argc, char **argv )
         }
     }
 
+    /* limiting the depth or stopping at matches only makes sense for the tree */
+    if ( args.max_depth > 0 || args.stop_at_match ) {
+        args.scan_tree = 1;
+    }
+
     if ( argc < 2 || args.help
             || ( args.rulefile == NULL && args.rulestr == NULL )) {
         usage();
@@ -114,6 +217,15 @@ main( int argc, char **argv )
 
     info( "[main] ghost initialized\n", ghost->conn );
 
+    ghost->match_all_windows = args.all_windows;
+    ghost->scan_tree = args.scan_tree;
+    ghost->scan_policy.max_depth = args.max_depth;
+    ghost->scan_max_requests = args.max_requests;
+    ghost->scan_policy.skip_unmapped = args.mapped_only;
+    ghost->scan_policy.stop_at_match = args.stop_at_match;
+    ghost->focus_debounce = args.focus_debounce;
+    ghost->use_active_window = args.active_window;
+
     /* load the rules */
     int loaded = 0;
     if ( args.rulefile != NULL ) {
@@ -135,16 +247,23 @@ main( int argc, char **argv )
     /* load windows */
     info( "[main] Loading windows...\n" );
 
+    /* in monitor mode, apply focus aware settings as windows are found */
+    ghost->apply_on_load = args.monitor;
+
+    /* and watch each window before fetching its properties */
+    ghost->watch_on_load = args.monitor;
+
+    /* otherwise, apply the normal settings without tracking anything */
+    ghost->streaming = !args.monitor;
+
     ght_load_windows( ghost );
 
     if ( !args.monitor ) {
-        /* perform a "once-and-done opacity setting */
-        info( "[main] Applying normal opacity rules\n" );
-        ght_apply_opacity_settings( ghost, false );
+        /* the once-and-done opacity settings were applied while loading */
+        info( "[main] Applied normal opacity rules\n" );
     } else {
         /* enter monitor mode */
         info( "[main] Entering monitor mode...\n" );
-        ght_apply_opacity_settings( ghost, true );
 
         /* down the rabbit hole, never to return ... */
         ght_monitor( ghost );
@@ -0,0 +1,141 @@
+/* check_ghost.c
+ *
+ * Tests for the ghost window matching logic. These need an X server;
+ * they are skipped if none can be reached through DISPLAY.
+ */
+
+#include <check.h>
+#include "../src/ghost.c"
+
+/* The exit status that tells automake a test was skipped */
+#define EXIT_SKIP 77
+
+/*
+ * Creates a ghost object with a rule that no window created by these
+ * tests matches.
+ */
+static ghost_t *
+create_ghost( void )
+{
+    char rules[] = "WM_CLASS(ghost-check-no-such-class) {f:0.5; n:0.5;}";
+    ghost_t *ghost = ght_create( NULL, NULL );
+
+    ck_assert_int_eq( 1, ght_load_rule_str( ghost, rules ));
+
+    return ghost;
+}
+
+/*
+ * Creates an unmapped top-level window without any properties.
+ */
+static xcb_window_t
+create_test_window( ghost_t *ghost )
+{
+    xcb_window_t win = xcb_generate_id( ghost->conn );
+
+    xcb_create_window( ghost->conn, XCB_COPY_FROM_PARENT, win, ghost->winroot,
+                       0, 0, 10, 10, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                       XCB_COPY_FROM_PARENT, 0, NULL );
+
+    return win;
+}
+
+/*
+ * Destroys the test window and the ghost object.
+ */
+static void
+clean_up( ghost_t *ghost, xcb_window_t win )
+{
+    xcb_destroy_window( ghost->conn, win );
+    xcb_flush( ghost->conn );
+    ght_destroy( ghost );
+}
+
+/* ########################### LOADING ########################## */
+
+START_TEST( test_load_window_list_watched_without_properties )
+{
+    /* arrange */
+    ghost_t *ghost = create_ghost();
+    xcb_window_t win = create_test_window( ghost );
+    ghost->watch_on_load = true;
+
+    /* act */
+    load_window_list( ghost, &win, NULL, 1, NULL );
+
+    /* assert: a window without any rule property is not a candidate */
+    ck_assert( find_window( ghost, win ) == NULL );
+    ck_assert( !is_known_nonmatching( ghost, win ));
+    ck_assert( ght_map_get( ghost->prop_cache, &win ) == NULL );
+    ck_assert( ght_map_get_entry( ghost->event_mask_map, &win ) == NULL );
+
+    /* clean up */
+    clean_up( ghost, win );
+}
+END_TEST
+
+START_TEST( test_load_window_list_unwatched_without_properties )
+{
+    /* arrange */
+    ghost_t *ghost = create_ghost();
+    xcb_window_t win = create_test_window( ghost );
+    ghost->watch_on_load = false;
+
+    /* act */
+    load_window_list( ghost, &win, NULL, 1, NULL );
+
+    /* assert */
+    ck_assert( find_window( ghost, win ) == NULL );
+    ck_assert( !is_known_nonmatching( ghost, win ));
+    ck_assert( ght_map_get( ghost->prop_cache, &win ) == NULL );
+
+    /* clean up */
+    clean_up( ghost, win );
+}
+END_TEST
+
+Suite *
+ghost_suite( void )
+{
+    TCase *tc_loading;
+    Suite *suite;
+
+    /* create the suite */
+    suite = suite_create( "ghost" );
+
+    /* build the Loading test case */
+    tc_loading = tcase_create( "Loading" );
+
+    /* add the individual tests */
+    tcase_add_test( tc_loading, test_load_window_list_watched_without_properties );
+    tcase_add_test( tc_loading, test_load_window_list_unwatched_without_properties );
+
+    suite_add_tcase( suite, tc_loading );
+
+    return suite;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+    xcb_connection_t *conn;
+
+    /* skip the tests if there is no X server to run them against */
+    conn = xcb_connect( NULL, NULL );
+    if ( xcb_connection_has_error( conn )) {
+        xcb_disconnect( conn );
+        return EXIT_SKIP;
+    }
+    xcb_disconnect( conn );
+
+    suite = ghost_suite();
+    runner = srunner_create( suite );
+
+    srunner_run_all( runner, CK_NORMAL );
+    number_failed = srunner_ntests_failed( runner );
+    srunner_free( runner );
+
+    return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
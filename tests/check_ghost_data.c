@@ -288,6 +288,81 @@ START_TEST( test_remove_ght_list_mod_for_each )
 }
 END_TEST
 
+/* ################ WINDOW ARRAYS ################ */
+
+/* Convenience object for initializing empty window arrays */
+static const win_array_t EMPTY_WIN_ARRAY = { NULL, 0, 0 };
+
+START_TEST( test_ght_win_array_push )
+{
+    /* arrange */
+    win_array_t array = EMPTY_WIN_ARRAY;
+    int i;
+
+    /* act */
+    for ( i=0; i<100; i++ ) {
+        ght_win_array_push( &array, (xcb_window_t) i + 1 );
+    }
+
+    /* assert */
+    ck_assert_int_eq( 100, array.count );
+    ck_assert( array.capacity >= 100 );
+    for ( i=0; i<100; i++ ) {
+        ck_assert_int_eq( i + 1, array.items[i] );
+    }
+
+    /* clean up */
+    ght_win_array_free( &array );
+}
+END_TEST
+
+START_TEST( test_ght_win_array_push_all )
+{
+    /* arrange */
+    win_array_t array = EMPTY_WIN_ARRAY;
+    xcb_window_t wins[] = { 0x10, 0x20, 0x30 };
+
+    ght_win_array_push( &array, 0x1 );
+
+    /* act */
+    ght_win_array_push_all( &array, wins, 3 );
+    ght_win_array_push_all( &array, wins, 0 );
+
+    /* assert */
+    ck_assert_int_eq( 4, array.count );
+    ck_assert_int_eq( 0x1, array.items[0] );
+    ck_assert_int_eq( 0x10, array.items[1] );
+    ck_assert_int_eq( 0x20, array.items[2] );
+    ck_assert_int_eq( 0x30, array.items[3] );
+
+    /* clean up */
+    ght_win_array_free( &array );
+}
+END_TEST
+
+START_TEST( test_ght_win_array_clear_and_free )
+{
+    /* arrange */
+    win_array_t array = EMPTY_WIN_ARRAY;
+    ght_win_array_push( &array, 0x1 );
+    ght_win_array_push( &array, 0x2 );
+
+    /* act/assert */
+    ght_win_array_clear( &array );
+    ck_assert_int_eq( 0, array.count );
+    ck_assert( array.items != NULL );
+
+    ght_win_array_push( &array, 0x3 );
+    ck_assert_int_eq( 1, array.count );
+    ck_assert_int_eq( 0x3, array.items[0] );
+
+    ght_win_array_free( &array );
+    ck_assert( array.items == NULL );
+    ck_assert_int_eq( 0, array.count );
+    ck_assert_int_eq( 0, array.capacity );
+}
+END_TEST
+
 /* ################### MAPS ###################### */
 
 START_TEST( test_ght_map_put_and_get )
@@ -487,6 +562,26 @@ START_TEST( test_ght_strmap_key_hash )
 }
 END_TEST
 
+START_TEST( test_ght_str_fold )
+{
+    /* arrange */
+    char buffer[16];
+    unsigned int hash;
+
+    /* act/assert */
+    ck_assert_int_eq( 5, ght_str_fold( buffer, "XTerm", 15, &hash ));
+    ck_assert_str_eq( "xterm", buffer );
+    ck_assert_int_eq( ght_strmap_key_hash( "xterm" ), hash );
+
+    /* stops at len characters or the first null */
+    ck_assert_int_eq( 3, ght_str_fold( buffer, "ABCDEF", 3, NULL ));
+    ck_assert_str_eq( "abc", buffer );
+    ck_assert_int_eq( 2, ght_str_fold( buffer, "AB\0CD", 5, &hash ));
+    ck_assert_str_eq( "ab", buffer );
+    ck_assert_int_eq( ght_strmap_key_hash( "ab" ), hash );
+}
+END_TEST
+
 START_TEST( test_ght_strmap_key_equals )
 {
     /* act/assert */
@@ -851,7 +946,7 @@ Suite *
 ghost_data_suite()
 {
     Suite *suite;
-    TCase *tc_list, *tc_map;
+    TCase *tc_list, *tc_win_array, *tc_map;
 
     suite = suite_create( "ghost_data" );
 
@@ -868,6 +963,16 @@ ghost_data_suite()
 
     suite_add_tcase( suite, tc_list );
 
+    /* build the window array test case */
+    tc_win_array = tcase_create( "Window Array" );
+
+    /* add individual tests */
+    tcase_add_test( tc_win_array, test_ght_win_array_push );
+    tcase_add_test( tc_win_array, test_ght_win_array_push_all );
+    tcase_add_test( tc_win_array, test_ght_win_array_clear_and_free );
+
+    suite_add_tcase( suite, tc_win_array );
+
     /* build the map test_case */
     tc_map = tcase_create( "Map" );
 
@@ -880,6 +985,7 @@ ghost_data_suite()
     tcase_add_test( tc_map, test_ght_map_remove );
     tcase_add_test( tc_map, test_ght_map_remove_not_found );
     tcase_add_test( tc_map, test_ght_strmap_key_hash );
+    tcase_add_test( tc_map, test_ght_str_fold );
     tcase_add_test( tc_map, test_ght_strmap_key_equals );
     tcase_add_test( tc_map, test_ght_strmap_key_copy );
     tcase_add_test( tc_map, test_ght_winmap );
@@ -885,6 +885,29 @@ START_TEST( test_read_matcher )
 }
 END_TEST
 
+START_TEST( test_read_matcher_folds_value )
+{
+    /* arrange */
+    ght_parser_t parser = DEFAULT_PARSER;
+    parser.input = str_file( "WM_CLASS(XTerm)" );
+
+    /* act */
+    ght_matcher_t *matcher = read_matcher( &parser );
+
+    /* assert */
+    ck_assert( NULL != matcher );
+
+    ck_assert_str_eq( "XTerm", matcher->value );
+    ck_assert_str_eq( "xterm", matcher->folded_value );
+    ck_assert_int_eq( 5, matcher->value_len );
+    ck_assert_int_eq( ght_strmap_key_hash( "xterm" ), matcher->value_hash );
+
+    /* clean up */
+    free( matcher );
+    fclose( parser.input );
+}
+END_TEST
+
 START_TEST( test_read_matcher_complex )
 {
     /* arrange */
@@ -1515,6 +1538,7 @@ ghost_parser_suite()
 
     /* add the individual tests */
     tcase_add_test( tc_parsing, test_read_matcher );
+    tcase_add_test( tc_parsing, test_read_matcher_folds_value );
     tcase_add_test( tc_parsing, test_read_matcher_complex );
     tcase_add_test( tc_parsing, test_read_matcher_failed );
 
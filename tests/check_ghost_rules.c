@@ -0,0 +1,636 @@
+/* check_ghost_rules.c
+ *
+ * Unit tests for the ghost rule compiling and matching logic.
+ */
+
+#include <check.h>
+#include "../src/ghost_rules.c"
+#include "../src/ghost_parser.h"
+
+/* Fake atoms used in place of interned X atoms */
+#define ATOM_WM_CLASS 1
+#define ATOM_WM_NAME 2
+#define ATOM_OTHER 3
+
+/*
+ * Parses the given rule string into the rule list and assigns fake
+ * atoms to the matchers.
+ */
+static int
+load_rules( char *str, list_t *rules )
+{
+    ght_rule_t *rule;
+    ght_matcher_t *matcher;
+
+    int count = ght_parse_rules_from_string( str, rules );
+
+    ght_list_for_each( rules, rule, ght_rule_t ) {
+        ght_list_for_each( &(rule->matchers), matcher, ght_matcher_t ) {
+            if ( strcmp( "WM_CLASS", matcher->name ) == 0 ) {
+                matcher->name_atom = ATOM_WM_CLASS;
+            } else if ( strcmp( "WM_NAME", matcher->name ) == 0 ) {
+                matcher->name_atom = ATOM_WM_NAME;
+            } else {
+                matcher->name_atom = ATOM_OTHER;
+            }
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Looks up the matcher with the given atom index and lowercased value,
+ * computing the value length and hash the way the rule set does.
+ */
+static int
+find_folded_matcher( ght_ruleset_t *ruleset, int atom_idx, const char *folded )
+{
+    return find_matcher( ruleset, atom_idx, folded, strlen( folded ),
+                         ght_strmap_key_hash( (void *) folded ));
+}
+
+/*
+ * Frees the matchers in the list.
+ */
+static void
+free_matchers( list_t *matchers )
+{
+    list_iter_t iter;
+    ght_matcher_t *matcher;
+
+    ght_list_mod_for_each( matchers, &iter, matcher, ght_matcher_t ) {
+        ght_list_remove( matchers, matcher );
+        free( matcher );
+    }
+}
+
+/*
+ * Frees the rules and matchers in the list.
+ */
+static void
+free_rules( list_t *rules )
+{
+    list_iter_t iter;
+    ght_rule_t *rule;
+
+    ght_list_mod_for_each( rules, &iter, rule, ght_rule_t ) {
+        free_matchers( &(rule->matchers) );
+        ght_list_remove( rules, rule );
+        free( rule );
+    }
+}
+
+/*
+ * Points value at the given string, which may be NULL.
+ */
+static void
+set_value( ght_value_t *value, char *str )
+{
+    value->data = str;
+    value->len = str != NULL ? strlen( str ) : 0;
+}
+
+/*
+ * Fills values with the window property values for the rule set atoms.
+ */
+static void
+set_values( ght_ruleset_t *ruleset, ght_value_t *values,
+            char *wm_class, char *wm_name, char *other )
+{
+    int i;
+    for ( i=0; i<ruleset->atom_count; i++ ) {
+        switch ( ruleset->atoms[i] ) {
+            case ATOM_WM_CLASS:
+                set_value( &(values[i]), wm_class );
+                break;
+            case ATOM_WM_NAME:
+                set_value( &(values[i]), wm_name );
+                break;
+            default:
+                set_value( &(values[i]), other );
+                break;
+        }
+    }
+}
+
+/* ########################### COMPILING ########################## */
+
+START_TEST( test_fold_value )
+{
+    /* arrange */
+    char buffer[MAX_STR_LEN + 1];
+    char long_value[MAX_STR_LEN + 10];
+    unsigned int hash;
+
+    memset( long_value, 'A', sizeof( long_value ));
+    long_value[MAX_STR_LEN + 9] = '\0';
+
+    /* act/assert */
+    ck_assert_int_eq( 5, fold_value( buffer, "XTerm", 5, &hash ));
+    ck_assert_str_eq( "xterm", buffer );
+    ck_assert_int_eq( ght_strmap_key_hash( "xterm" ), hash );
+
+    ck_assert_int_eq( 0, fold_value( buffer, "", 0, &hash ));
+    ck_assert_str_eq( "", buffer );
+
+    ck_assert_int_eq( MAX_STR_LEN, fold_value( buffer, long_value, MAX_STR_LEN + 9, &hash ));
+    ck_assert_int_eq( MAX_STR_LEN, strlen( buffer ));
+    ck_assert( 'a' == buffer[0] );
+
+    /* values are not expected to be null terminated */
+    ck_assert_int_eq( 2, fold_value( buffer, "XTerm", 2, &hash ));
+    ck_assert_str_eq( "xt", buffer );
+
+    /* but stop at a null, as in WM_CLASS */
+    ck_assert_int_eq( 5, fold_value( buffer, "XTerm\0XTerm\0", 12, &hash ));
+    ck_assert_str_eq( "xterm", buffer );
+    ck_assert_int_eq( ght_strmap_key_hash( "xterm" ), hash );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_create_prefolded_values )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(XTerm) {f:1;} WM_CLASS(xterm) {f:1;}", &rules );
+
+    /* act */
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* assert */
+    ck_assert_int_eq( 1, ruleset->matcher_count );
+    ck_assert_int_eq( 5, ruleset->matcher_lens[0] );
+    ck_assert_int_eq( ght_strmap_key_hash( "xterm" ), ruleset->matcher_hashes[0] );
+    ck_assert_str_eq( "xterm", ruleset->value_blob + ruleset->matcher_values[0] );
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_create_distinct_atoms )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(a) WM_NAME(b), WM_CLASS(c) {f:1;} "
+                "WM_NAME(d) {f:1;} "
+                "WM_CLASS(e) {f:1;}", &rules );
+
+    /* act */
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* assert */
+    ck_assert_int_eq( 4, ruleset->rule_count );
+    ck_assert_int_eq( 2, ruleset->atom_count );
+    ck_assert_int_eq( ATOM_WM_CLASS, ruleset->atoms[0] );
+    ck_assert_int_eq( ATOM_WM_NAME, ruleset->atoms[1] );
+
+    ck_assert_int_eq( 0, ruleset->matcher_atoms[0] );
+    ck_assert_int_eq( 1, ruleset->matcher_atoms[1] );
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_atom_index )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(a) {f:1;} WM_NAME(b) {f:1;}", &rules );
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* act/assert */
+    ck_assert_int_eq( 0, ght_ruleset_atom_index( ruleset, ATOM_WM_CLASS ));
+    ck_assert_int_eq( 1, ght_ruleset_atom_index( ruleset, ATOM_WM_NAME ));
+    ck_assert_int_eq( -1, ght_ruleset_atom_index( ruleset, ATOM_OTHER ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_create_flattens_rules )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(XTerm) WM_NAME(b) {f:0.2; n:0.4;} "
+                "WM_CLASS(xterm) {f:0.6; n:0.8;} "
+                "WM_NAME(xterm) {f:1;}", &rules );
+
+    /* act */
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* the rule set should not depend on the list */
+    free_rules( &rules );
+
+    /* assert */
+    ck_assert_int_eq( 3, ruleset->rule_count );
+    ck_assert_int_eq( 3, ruleset->matcher_count );
+
+    /* rule matcher ranges */
+    ck_assert_int_eq( 0, ruleset->rule_matchers[0] );
+    ck_assert_int_eq( 2, ruleset->rule_matchers[1] );
+    ck_assert_int_eq( 3, ruleset->rule_matchers[2] );
+    ck_assert_int_eq( 4, ruleset->rule_matchers[3] );
+
+    ck_assert_int_eq( 0, ruleset->rule_matcher_bits[0] );
+    ck_assert_int_eq( 1, ruleset->rule_matcher_bits[1] );
+    ck_assert_int_eq( 0, ruleset->rule_matcher_bits[2] );
+    ck_assert_int_eq( 2, ruleset->rule_matcher_bits[3] );
+
+    /* values are lowercased and shared */
+    ck_assert_str_eq( "xterm", ruleset->value_blob + ruleset->matcher_values[0] );
+    ck_assert_str_eq( "b", ruleset->value_blob + ruleset->matcher_values[1] );
+    ck_assert_str_eq( "xterm", ruleset->value_blob + ruleset->matcher_values[2] );
+    ck_assert( ruleset->matcher_values[0] != ruleset->matcher_values[2] );
+
+    /* opacities */
+    ck_assert_int_eq( 2, (int)( ruleset->focus_opacity[0] * 10 ));
+    ck_assert_int_eq( 4, (int)( ruleset->normal_opacity[0] * 10 ));
+    ck_assert_int_eq( 6, (int)( ruleset->focus_opacity[1] * 10 ));
+    ck_assert_int_eq( 8, (int)( ruleset->normal_opacity[1] * 10 ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_create_candidates )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(XTerm) WM_NAME(b) {f:1;} "
+                "WM_NAME(c) {f:1;} "
+                "WM_CLASS(xterm) {f:1;} "
+                "WM_NAME(b) {f:1;}", &rules );
+
+    /* act */
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* assert */
+    ck_assert_int_eq( 3, ruleset->matcher_count );
+
+    /* WM_CLASS(xterm) is first in rules 0 and 2 */
+    ck_assert_int_eq( 0, ruleset->matcher_candidates[0] );
+    ck_assert_int_eq( 2, ruleset->matcher_candidates[1] );
+    ck_assert_int_eq( 0, ruleset->candidates[0] );
+    ck_assert_int_eq( 2, ruleset->candidates[1] );
+
+    /* WM_NAME(b) is first in rule 3 */
+    ck_assert_int_eq( 3, ruleset->matcher_candidates[2] );
+    ck_assert_int_eq( 3, ruleset->candidates[2] );
+
+    /* WM_NAME(c) is first in rule 1 */
+    ck_assert_int_eq( 4, ruleset->matcher_candidates[3] );
+    ck_assert_int_eq( 1, ruleset->candidates[3] );
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_find_matcher )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(XTerm) WM_NAME(b) {f:1;} "
+                "WM_NAME(xterm) {f:1;}", &rules );
+
+    /* act */
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* assert */
+    ck_assert_int_eq( 0, find_folded_matcher( ruleset, 0, "xterm" ));
+    ck_assert_int_eq( 1, find_folded_matcher( ruleset, 1, "b" ));
+    ck_assert_int_eq( 2, find_folded_matcher( ruleset, 1, "xterm" ));
+    ck_assert_int_eq( -1, find_folded_matcher( ruleset, 0, "b" ));
+    ck_assert_int_eq( -1, find_folded_matcher( ruleset, 0, "XTerm" ));
+
+    /* the stored length and hash must agree with the value */
+    ck_assert_int_eq( -1, find_matcher( ruleset, 0, "xterm", 4,
+                                        ght_strmap_key_hash( "xterm" )));
+    ck_assert_int_eq( -1, find_matcher( ruleset, 0, "xterm", 5, 0 ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_create_empty )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    ght_value_t values[1] = { { NULL, 0 } };
+
+    /* act */
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* assert */
+    ck_assert_int_eq( 0, ruleset->rule_count );
+    ck_assert_int_eq( 0, ruleset->atom_count );
+    ck_assert_int_eq( GHT_NO_RULE, ght_ruleset_match( ruleset, values ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_create_masks )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(xterm) WM_NAME(b) {f:1;} "
+                "WM_CLASS(XTERM) {f:1;} "
+                "WM_NAME(b) WM_NAME(c) {f:1;}", &rules );
+
+    /* act */
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+
+    /* assert */
+    ck_assert_int_eq( 3, ruleset->matcher_count );
+    ck_assert_int_eq( 1, ruleset->mask_words );
+
+    ck_assert( 0x3 == ruleset->rule_masks[0] );
+    ck_assert( 0x1 == ruleset->rule_masks[1] );
+    ck_assert( 0x6 == ruleset->rule_masks[2] );
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_mask_is_subset )
+{
+    /* arrange */
+    ght_mask_word_t set[2] = { 0, 0 };
+    ght_mask_word_t mask[2] = { 0, 0 };
+
+    mask_set( set, 3 );
+    mask_set( set, 70 );
+    mask_set( set, 100 );
+
+    /* act/assert */
+    ck_assert( mask_is_subset( mask, set, 2 ));
+
+    mask_set( mask, 70 );
+    ck_assert( mask_is_subset( mask, set, 2 ));
+
+    mask_set( mask, 3 );
+    ck_assert( mask_is_subset( mask, set, 2 ));
+
+    mask_set( mask, 64 );
+    ck_assert( !mask_is_subset( mask, set, 2 ));
+}
+END_TEST
+
+/* ########################### MATCHING ########################### */
+
+START_TEST( test_ght_ruleset_match )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(xterm) WM_NAME(home) {f:0.1;} "
+                "WM_CLASS(xterm) {f:0.2;} "
+                "WM_NAME(clock) {f:0.3;}", &rules );
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+    ght_value_t values[2];
+
+    /* act/assert */
+    set_values( ruleset, values, "XTerm", "Home", NULL );
+    ck_assert_int_eq( 0, ght_ruleset_match( ruleset, values ));
+
+    set_values( ruleset, values, "xterm", "other", NULL );
+    ck_assert_int_eq( 1, ght_ruleset_match( ruleset, values ));
+
+    set_values( ruleset, values, NULL, "CLOCK", NULL );
+    ck_assert_int_eq( 2, ght_ruleset_match( ruleset, values ));
+
+    set_values( ruleset, values, "xclock", "home", NULL );
+    ck_assert_int_eq( GHT_NO_RULE, ght_ruleset_match( ruleset, values ));
+
+    set_values( ruleset, values, NULL, NULL, NULL );
+    ck_assert_int_eq( GHT_NO_RULE, ght_ruleset_match( ruleset, values ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_match_uses_first_rule_across_atoms )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_NAME(home) {f:0.1;} "
+                "WM_CLASS(xterm) {f:0.2;}", &rules );
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+    ght_value_t values[2];
+
+    /* act */
+    set_values( ruleset, values, "xterm", "home", NULL );
+    int idx = ght_ruleset_match( ruleset, values );
+
+    /* assert */
+    ck_assert_int_eq( 0, idx );
+    ck_assert_int_eq( 1, (int)( ruleset->focus_opacity[idx] * 10 ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_match_many_matchers )
+{
+    /* arrange */
+    char rule_str[8192] = "";
+    char buffer[64];
+    list_t rules = { NULL, NULL };
+    int i;
+
+    /* two matchers per rule so the masks spill over several words */
+    for ( i=0; i<100; i++ ) {
+        sprintf( buffer, "WM_CLASS(c%d) WM_NAME(n%d) {f:1;} ", i, i );
+        strcat( rule_str, buffer );
+    }
+    load_rules( rule_str, &rules );
+
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+    ght_value_t values[2];
+
+    /* act/assert */
+    ck_assert_int_eq( 200, ruleset->matcher_count );
+    ck_assert_int_eq( 4, ruleset->mask_words );
+
+    set_values( ruleset, values, "c73", "n73", NULL );
+    ck_assert_int_eq( 73, ght_ruleset_match( ruleset, values ));
+
+    set_values( ruleset, values, "c73", "n74", NULL );
+    ck_assert_int_eq( GHT_NO_RULE, ght_ruleset_match( ruleset, values ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_match_memoizes_results )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(xterm) WM_NAME(home) {f:0.1;} "
+                "WM_CLASS(xterm) {f:0.2;}", &rules );
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+    ght_value_t values[2];
+
+    /* act/assert */
+    set_values( ruleset, values, "xterm", "home", NULL );
+    ck_assert_int_eq( 0, ght_ruleset_match( ruleset, values ));
+    ck_assert_int_eq( 0, ruleset->memo_hits );
+    ck_assert_int_eq( 1, ruleset->memo_misses );
+
+    /* values that differ only in case share a memo entry */
+    set_values( ruleset, values, "XTerm", "HOME", NULL );
+    ck_assert_int_eq( 0, ght_ruleset_match( ruleset, values ));
+    ck_assert_int_eq( 1, ruleset->memo_hits );
+
+    set_values( ruleset, values, "xterm", NULL, NULL );
+    ck_assert_int_eq( 1, ght_ruleset_match( ruleset, values ));
+    ck_assert_int_eq( 2, ruleset->memo_misses );
+
+    set_values( ruleset, values, "xclock", NULL, NULL );
+    ck_assert_int_eq( GHT_NO_RULE, ght_ruleset_match( ruleset, values ));
+    ck_assert_int_eq( GHT_NO_RULE, ght_ruleset_match( ruleset, values ));
+    ck_assert_int_eq( 2, ruleset->memo_hits );
+    ck_assert_int_eq( 3, ruleset->memo_misses );
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_build_memo_key )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(a) WM_NAME(b) {f:1;}", &rules );
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+    ght_value_t values[2];
+    key_value_t folded[2];
+    int len;
+
+    /* act/assert */
+    set_values( ruleset, values, "Ab", NULL, NULL );
+    len = build_memo_key( ruleset, values, ruleset->memo_scratch, folded );
+
+    ck_assert_int_eq( 5, len );
+    ck_assert_int_eq( 1, folded[0].offset );
+    ck_assert_int_eq( 2, folded[0].len );
+    ck_assert_int_eq( ght_strmap_key_hash( "ab" ), folded[0].hash );
+    ck_assert_int_eq( -1, folded[1].offset );
+    ck_assert( 0 == memcmp( "\001ab\000\000", ruleset->memo_scratch, 5 ));
+
+    /* a missing value and an empty value give different keys */
+    set_values( ruleset, values, "Ab", "", NULL );
+    len = build_memo_key( ruleset, values, ruleset->memo_scratch, folded );
+
+    ck_assert_int_eq( 6, len );
+    ck_assert_int_eq( 5, folded[1].offset );
+    ck_assert_int_eq( 0, folded[1].len );
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+START_TEST( test_ght_ruleset_match_unterminated_values )
+{
+    /* arrange */
+    list_t rules = { NULL, NULL };
+    load_rules( "WM_CLASS(xterm) WM_NAME(home) {f:0.1;}", &rules );
+    ght_ruleset_t *ruleset = ght_ruleset_create( &rules );
+    ght_value_t values[2];
+
+    /* act/assert */
+    set_values( ruleset, values, "xterm\0XTerm", "homeward", NULL );
+    values[0].len = 11;
+    values[1].len = 4;
+    ck_assert_int_eq( 0, ght_ruleset_match( ruleset, values ));
+
+    values[1].len = 5;
+    ck_assert_int_eq( GHT_NO_RULE, ght_ruleset_match( ruleset, values ));
+
+    /* clean up */
+    ght_ruleset_free( ruleset );
+    free_rules( &rules );
+}
+END_TEST
+
+/* ##################### TEST SETUP ################### */
+
+Suite *
+ghost_rules_suite()
+{
+    Suite *suite;
+    TCase *tc_compiling, *tc_matching;
+
+    suite = suite_create( "ghost_rules" );
+
+    /* build the Compiling test case */
+    tc_compiling = tcase_create( "Compiling" );
+
+    /* add the individual tests */
+    tcase_add_test( tc_compiling, test_fold_value );
+    tcase_add_test( tc_compiling, test_ght_ruleset_create_prefolded_values );
+    tcase_add_test( tc_compiling, test_ght_ruleset_create_distinct_atoms );
+    tcase_add_test( tc_compiling, test_ght_ruleset_atom_index );
+    tcase_add_test( tc_compiling, test_ght_ruleset_create_flattens_rules );
+    tcase_add_test( tc_compiling, test_ght_ruleset_create_candidates );
+    tcase_add_test( tc_compiling, test_find_matcher );
+    tcase_add_test( tc_compiling, test_ght_ruleset_create_empty );
+    tcase_add_test( tc_compiling, test_ght_ruleset_create_masks );
+    tcase_add_test( tc_compiling, test_mask_is_subset );
+
+    suite_add_tcase( suite, tc_compiling );
+
+    /* build the Matching test case */
+    tc_matching = tcase_create( "Matching" );
+
+    /* add the individual tests */
+    tcase_add_test( tc_matching, test_ght_ruleset_match );
+    tcase_add_test( tc_matching, test_ght_ruleset_match_uses_first_rule_across_atoms );
+    tcase_add_test( tc_matching, test_ght_ruleset_match_many_matchers );
+    tcase_add_test( tc_matching, test_ght_ruleset_match_memoizes_results );
+    tcase_add_test( tc_matching, test_build_memo_key );
+    tcase_add_test( tc_matching, test_ght_ruleset_match_unterminated_values );
+
+    suite_add_tcase( suite, tc_matching );
+
+    return suite;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *suite;
+    SRunner *runner;
+
+    suite = ghost_rules_suite();
+    runner = srunner_create( suite );
+
+    srunner_run_all( runner, CK_NORMAL );
+    number_failed = srunner_ntests_failed( runner );
+    srunner_free( runner );
+
+    return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}